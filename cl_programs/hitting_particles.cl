@@ -1,101 +1,179 @@
 #include "particles_structs.cl"
 #include "particles_random.cl"
+#include "particles_spawn.cl"
 
 typedef struct {
 	float3 position;
 	float radius;
 } enemy_data_t __attribute__ ((aligned (16)));
 
+//Range in grid_enemies of the enemies in a hash bucket
+typedef struct {
+	int start;
+	int count;
+} grid_cell_t;
+
+//Damage and number of hits on an enemy this frame
+typedef struct {
+	float damage;
+	int count;
+} enemy_hit_t;
+
+void atomic_add_float(volatile __global float * address, const float value) {
+	union { uint u; float f; } expected, desired;
+	do {
+		expected.f = *address;
+		desired.f = expected.f + value;
+	} while(atomic_cmpxchg((volatile __global uint *) address, expected.u, desired.u) != expected.u);
+}
+
+//Must be same as HittingParticles::grid_hash
+uint grid_hash(int3 cell, uint num_buckets) {
+	return (((uint)cell.x * 73856093u) ^ ((uint)cell.y * 19349663u) ^ ((uint)cell.z * 83492791u)) & (num_buckets - 1);
+}
+
 __kernel void run_particles (
-														 __global vertex_t * vertices, 
+														 __global float4 * positions, //xyz and rotation
+														 __global float4 * velocities, //xyz and rotation speed
 														 __global particle_t * particles, 
-														 __constant config_t * config, 
-														 __global const float * rnd,
+														 __global const palette_entry_t * palette,
+														 __constant emitter_t * emitters,
+														 __constant config_t * configs, //One per emitter
+														 uint num_emitters,
+														 uint seed, //Key of the random streams
+														 __global int * free_list,
+														 __global int * free_counts, //One per emitter
+														 __global vertex_t * draw_vertices, //Live vertices, compacted
+														 __global draw_args_t * draw_args, //count must be reset before each run
 														 float dt,
-														 uint time,
+														 uint frame, //Update counter, part of the random counter
 														 __global const enemy_data_t * enemies,
-														 uint num_enemies
+														 uint num_enemies,
+														 __global const grid_cell_t * grid, //Spatial hash of the enemies
+														 __global const int * grid_enemies,
+														 uint num_buckets, //Power of two
+														 float cell_size, //At least max enemy radius + max particle radius
+														 __global enemy_hit_t * hits, //One per enemy, cleared each frame
+														 __global int * hit_list, //Number of enemies hit, then their indices. The number is cleared each frame
+														 __global const float * heightfield, //Terrain heights, row major
+														 int2 heightfield_size, //0 without terrain
+														 float heightfield_scale, //World units between two heights
+														 __global const float4 * turbulence, //Tiling field of TURBULENCE_SIZE^3 velocities
+														 float4 turbulence_offset //xyz added to positions before sampling, w is cells per world unit
 														 )
 {
 	uint id = get_global_id(0);
-	if(particles[id].dead == 0) {
-		float radius = vertices[id].scale * 0.5f * 0.1f; //All particle scales are scaled down with 0.1
-		float3 center = vertices[id].position.xyz - (float3)(0.5, 0.5, 0.5) * 0.1 * vertices[id].scale;
-		particles[id].ttl -= dt;
+	float ttl = particles[id].ttl;
+	if(ttl > 0) {
+		int e = emitter_index(emitters, num_emitters, id);
+		__constant config_t * config = &configs[e];
 		bool hit = false;
-		for(int e = 0; e < num_enemies; ++e) {
-			if( fast_distance(center, enemies[e].position) < enemies[e].radius + radius) {
-				hit = true;
-				particles[id].extra1 = e;
-				break;
+		if(num_enemies > 0 && emitters[e].hit_test) {
+			//Test the particle as it was drawn last frame
+			float scale = mix(load_half(particles[id].initial_scale), load_half(particles[id].final_scale), 1.0 - (ttl/load_half(particles[id].org_ttl)));
+			float radius = scale * 0.5f * 0.1f; //All particle scales are scaled down with 0.1
+			float3 center = positions[id].xyz - (float3)(0.5, 0.5, 0.5) * 0.1 * scale;
+			__global const palette_entry_t * colors = &palette[particles[id].palette_index];
+
+			//Only enemies in our own and the neighbouring cells can be close enough
+			int3 cell = convert_int3(floor(center / cell_size));
+			for(int n = 0; n < 27 && !hit; ++n) {
+				grid_cell_t c = grid[grid_hash(cell + (int3)(n % 3 - 1, (n / 3) % 3 - 1, n / 9 - 1), num_buckets)];
+				for(int i = 0; i < c.count; ++i) {
+					int enemy = grid_enemies[c.start + i];
+					if( fast_distance(center, enemies[enemy].position) < enemies[enemy].radius + radius) {
+						hit = true;
+						atomic_add_float(&hits[enemy].damage, colors->damage);
+						if(atomic_inc(&hits[enemy].count) == 0) {
+							//First hit on it, spawn_impacts only visits the listed enemies
+							hit_list[1 + atomic_inc(&hit_list[0])] = enemy;
+						}
+						break;
+					}
+				}
 			}
 		}
 
-		if(!hit && particles[id].ttl > 0) {
-			float life_progression = 1.0 - (particles[id].ttl/particles[id].org_ttl);
-
-			particles[id].velocity += config->gravity.xyz * particles[id].gravity_influence * dt;
-			particles[id].velocity -= (particles[id].velocity - config->wind_velocity.xyz) * particles[id].wind_influence * dt;
+		float4 position = positions[id];
+
+		//Distant particles are run every step frames, spread over the frames by id
+		float distance = fast_distance(position.xyz, config->lod_camera.xyz);
+		uint step = lod_step(config, distance);
+		bool run = ((id + frame) & (step - 1)) == 0;
+		float step_dt = dt * step;
+
+		//A hit kills the particle
+		if(run || hit) {
+			ttl = hit ? 0.f : ttl - step_dt;
+			if(ttl > 0) {
+				rng_t rng = rng_init(id, frame, seed, RNG_STREAM_RUN);
+				integrate_particle(config, &particles[id], &velocities[id], &position, step_dt, &rng, turbulence, turbulence_offset);
+				if(!collide_ground(config, heightfield, heightfield_size, heightfield_scale, &position, &velocities[id])) ttl = 0.f;
+				positions[id] = position;
+			}
+			particles[id].ttl = ttl;
+		}
 
-			vertices[id].position.xyz += (particles[id].velocity + random3(config->motion_rand.xyz, true)) * dt;
-			vertices[id].position.w += particles[id].rotation_speed * dt;
+		if(ttl > 0) {
+			__global const palette_entry_t * colors = &palette[particles[id].palette_index];
+
+			//Skipped particles are drawn too, the draw buffer is compacted every frame
+			vertex_t v;
+			vstore4(position, 0, v.position);
+			if(lod_interpolate(config, distance)) {
+				float life_progression = 1.0 - (ttl/load_half(particles[id].org_ttl));
+				v.color = convert_uchar4_sat_rte(mix(colors->birth_color, colors->death_color, life_progression) * 255.f);
+				vstore_half(mix(load_half(particles[id].initial_scale), load_half(particles[id].final_scale), life_progression), 0, (half*) &v.scale);
+			} else {
+				v.color = convert_uchar4_sat_rte(colors->birth_color * 255.f);
+				v.scale = particles[id].initial_scale;
+			}
+			v.texture_index = particles[id].texture_index;
 
-			vertices[id].color = mix(config->birth_color, config->death_color, life_progression);
-			vertices[id].color = mix(particles[id].birth_color, particles[id].death_color, life_progression);
-			vertices[id].scale = mix(particles[id].initial_scale, particles[id].final_scale, life_progression);
+			//Only live particles are drawn
+			draw_vertices[atomic_inc(&draw_args->count)] = v;
 
 		} else {
-			//Dead!
-			vertices[id].color.w = 0.0;
-			vertices[id].scale = 0.0;
-			particles[id].dead = 1;
+			//Dead! Return the slot to the free list of our emitter
+			free_particle(&emitters[e], e, free_list, free_counts, id);
 		}
-	} else {
-		particles[id].extra1 = -1; //Hit enemy, unset
 	}
 
 }
 
-__kernel void spawn_particles (
-														 __global vertex_t * vertices, 
-														 __global particle_t * particles, 
-														 __constant config_t * config, 
-														 __global const float * rnd,
-														 __global int * to_spawn, //Number of particles left to spawn, use atomic operations!
-														 uint time
+//Spawns count particles of impact_config at each enemy hit by the last run, enqueued right after it
+__kernel void spawn_impacts (
+														 __global float4 * positions,
+														 __global float4 * velocities,
+														 __global particle_t * particles,
+														 __constant emitter_t * emitters,
+														 __global const config_t * impact_config,
+														 uint seed, //Key of the random streams
+														 __global const int * free_list,
+														 __global int * free_counts,
+														 __global const enemy_data_t * enemies,
+														 __global const int * hit_list, //Written by the run
+														 int emitter, //Of the spawned particles
+														 uint palette_index,
+														 uint count, //Per hit enemy
+														 uint lanes, //Hit enemies visited at the same time
+														 uint frame
 														 )
 {
-	uint id = get_global_id(0);
-
-	if (particles[id].dead == 1 && to_spawn[0] > 0 && atomic_dec(&to_spawn[0]) > 0 ) {
-		vertices[id].position.xyz = config->spawn_position.xyz + random3(config->spawn_area.xyz, false);
-
-		//Save colors to allow changing config during runtime
-		particles[id].birth_color = config->birth_color;
-		particles[id].death_color = config->death_color;
-
-		float a = random1(2*M_PI, false);
-		float a2 = random1(2*M_PI, false);
-		float len = random1(config->spawn_area.w,false);
-		vertices[id].position.x += len * cos(a);
-		vertices[id].position.y += len * sin(a);
-		vertices[id].position.z += len * sin(a) * cos(a2);
-
-		vertices[id].position.w = 0.f;
-		vertices[id].texture_index = config->start_texture + (int)floor(random1((float)(config->num_textures-0.1), false));
-
-		particles[id].wind_influence = config->avg_wind_influence + random1(config->wind_influence_var, true);
-		particles[id].gravity_influence = config->avg_gravity_influence + random1(config->gravity_influence_var, true);
-
-		particles[id].velocity = config->avg_spawn_velocity.xyz + random3(config->spawn_velocity_var.xyz, true);
-		particles[id].org_ttl = particles[id].ttl = config->avg_ttl + random1(config->ttl_var, true);
-		particles[id].rotation_speed = config->avg_rotation_speed + random1(config->rotation_speed_var, true);
-		particles[id].initial_scale = config->avg_scale + random1(config->scale_var, true);
-		particles[id].final_scale = particles[id].initial_scale + config->avg_scale_change + random1(config->scale_change_var, true);
-		particles[id].dead = 0;
-		particles[id].extra1 = -1; //Hit enemy
-		particles[id].extra3 = config->extra; //Particle damage
+	//count work-items per lane, lane l spawns at hit enemy l, l + lanes and so on
+	uint gid = get_global_id(0);
+	uint k = gid % count;
+	uint num_hits = hit_list[0];
+	for(uint h = gid / count; h < num_hits; h += lanes) {
+		int slot = atomic_dec(&free_counts[emitter]) - 1;
+		if(slot < 0) {
+			//Emitter is full, undo the pop
+			atomic_inc(&free_counts[emitter]);
+			return;
+		}
 
+		uint id = emitters[emitter].first + free_list[emitters[emitter].first + slot];
+		rng_t rng = rng_init(h * count + k, frame, seed, RNG_STREAM_IMPACT);
+		init_particle(positions, velocities, particles, impact_config, enemies[hit_list[1 + h]].position, (uchar) palette_index, id, &rng);
 	}
 }
-
@@ -1,77 +1,76 @@
 #include "particles_structs.cl"
 #include "particles_random.cl"
+#include "particles_spawn.cl"
 
 __kernel void run_particles (
-														 __global vertex_t * vertices, 
+														 __global float4 * positions, //xyz and rotation
+														 __global float4 * velocities, //xyz and rotation speed
 														 __global particle_t * particles, 
-														 __constant config_t * config, 
-														 __global const float * rnd,
+														 __global const palette_entry_t * palette,
+														 __constant emitter_t * emitters,
+														 __constant config_t * configs, //One per emitter
+														 uint num_emitters,
+														 uint seed, //Key of the random streams
+														 __global int * free_list,
+														 __global int * free_counts, //One per emitter
+														 __global vertex_t * draw_vertices, //Live vertices, compacted
+														 __global draw_args_t * draw_args, //count must be reset before each run
 														 float dt,
-														 uint time
+														 uint frame, //Update counter, part of the random counter
+														 __global const float * heightfield, //Terrain heights, row major
+														 int2 heightfield_size, //0 without terrain
+														 float heightfield_scale, //World units between two heights
+														 __global const float4 * turbulence, //Tiling field of TURBULENCE_SIZE^3 velocities
+														 float4 turbulence_offset //xyz added to positions before sampling, w is cells per world unit
 														 )
 {
 	uint id = get_global_id(0);
-	if(particles[id].dead == 0) {
-		particles[id].ttl -= dt;
-		if(particles[id].ttl > 0) {
-			float life_progression = 1.0 - (particles[id].ttl/particles[id].org_ttl);
+	float ttl = particles[id].ttl;
+	if(ttl > 0) {
+		int e = emitter_index(emitters, num_emitters, id);
+		__constant config_t * config = &configs[e];
+		float4 position = positions[id];
 
-			particles[id].velocity += config->gravity.xyz * particles[id].gravity_influence * dt;
-			particles[id].velocity -= (particles[id].velocity - config->wind_velocity.xyz) * particles[id].wind_influence * dt;
+		//Distant particles are run every step frames, spread over the frames by id
+		float distance = fast_distance(position.xyz, config->lod_camera.xyz);
+		uint step = lod_step(config, distance);
+		bool run = ((id + frame) & (step - 1)) == 0;
+		float step_dt = dt * step;
 
-			vertices[id].position.xyz += (particles[id].velocity + random3(config->motion_rand.xyz, true)) * dt;
-			vertices[id].position.w += particles[id].rotation_speed * dt;
-
-			vertices[id].color = mix(particles[id].birth_color, particles[id].death_color, life_progression);
-			vertices[id].scale = mix(particles[id].initial_scale, particles[id].final_scale, life_progression);
-
-		} else {
-			//Dead!
-			vertices[id].color.w = 0.0;
-			vertices[id].scale = 0.0;
-			particles[id].dead = 1;
+		if(run) {
+			ttl -= step_dt;
+			if(ttl > 0) {
+				rng_t rng = rng_init(id, frame, seed, RNG_STREAM_RUN);
+				integrate_particle(config, &particles[id], &velocities[id], &position, step_dt, &rng, turbulence, turbulence_offset);
+				if(!collide_ground(config, heightfield, heightfield_size, heightfield_scale, &position, &velocities[id])) ttl = 0.f;
+				positions[id] = position;
+			}
+			particles[id].ttl = ttl;
 		}
-	}
 
-}
+		if(ttl > 0) {
+			__global const palette_entry_t * colors = &palette[particles[id].palette_index];
 
-__kernel void spawn_particles (
-														 __global vertex_t * vertices, 
-														 __global particle_t * particles, 
-														 __constant config_t * config, 
-														 __global const float * rnd,
-														 __global int * to_spawn, //Number of particles left to spawn, use atomic operations!
-														 uint time
-														 )
-{
-	uint id = get_global_id(0);
+			//Skipped particles are drawn too, the draw buffer is compacted every frame
+			vertex_t v;
+			vstore4(position, 0, v.position);
+			if(lod_interpolate(config, distance)) {
+				float life_progression = 1.0 - (ttl/load_half(particles[id].org_ttl));
+				v.color = convert_uchar4_sat_rte(mix(colors->birth_color, colors->death_color, life_progression) * 255.f);
+				vstore_half(mix(load_half(particles[id].initial_scale), load_half(particles[id].final_scale), life_progression), 0, (half*) &v.scale);
+			} else {
+				v.color = convert_uchar4_sat_rte(colors->birth_color * 255.f);
+				v.scale = particles[id].initial_scale;
+			}
+			v.texture_index = particles[id].texture_index;
 
-	if (particles[id].dead == 1 && to_spawn[0] > 0 && atomic_dec(&to_spawn[0]) > 0 ) {
-		vertices[id].position.xyz = config->spawn_position.xyz + random3(config->spawn_area.xyz, false);
+			//Only live particles are drawn
+			draw_vertices[atomic_inc(&draw_args->count)] = v;
 
-		//Save colors to allow changing config during runtime
-		particles[id].birth_color = config->birth_color;
-		particles[id].death_color = config->death_color;
-
-		float a = random1(2*M_PI, false);
-		float a2 = random1(2*M_PI, false);
-		float len = random1(config->spawn_area.w,false);
-		vertices[id].position.x += len * cos(a);
-		vertices[id].position.y += len * sin(a);
-		vertices[id].position.z += len * sin(a) * cos(a2);
-
-		vertices[id].position.w = 0.f;
-		vertices[id].texture_index = config->start_texture + (int)floor(random1((float)(config->num_textures-0.1), false));
-
-		particles[id].wind_influence = config->avg_wind_influence + random1(config->wind_influence_var, true);
-		particles[id].gravity_influence = config->avg_gravity_influence + random1(config->gravity_influence_var, true);
-
-		particles[id].velocity = config->avg_spawn_velocity.xyz + random3(config->spawn_velocity_var.xyz, true);
-		particles[id].org_ttl = particles[id].ttl = config->avg_ttl + random1(config->ttl_var, true);
-		particles[id].rotation_speed = config->avg_rotation_speed + random1(config->rotation_speed_var, true);
-		particles[id].initial_scale = config->avg_scale + random1(config->scale_var, true);
-		particles[id].final_scale = particles[id].initial_scale + config->avg_scale_change + random1(config->scale_change_var, true);
-		particles[id].dead = 0;
+		} else {
+			//Dead! Return the slot to the free list of our emitter
+			free_particle(&emitters[e], e, free_list, free_counts, id);
+		}
 	}
-}
 
+}
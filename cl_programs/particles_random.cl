@@ -1,34 +1,90 @@
-float random(uint *time, const uint id, __global const float * const rnd, const int max_num_particles) {
-	float r = rnd[(int)((*time)+id) % max_num_particles];
-	//Change time to not get same value next call:
-	(*time)++;
-	return r;
+/*
+ * Counter based random numbers (Philox4x32-10, Salmon et al. 2011).
+ * Each work-item keys its own stream on (id, frame, stream) and the seed,
+ * so nothing is read from memory and no state is kept between launches.
+ * One round gives four numbers, _random1 and _random3 use them up before the next round.
+ */
+
+//Streams, so the spawn and run kernels never draw the same numbers
+#define RNG_STREAM_RUN 0
+#define RNG_STREAM_SPAWN 1
+#define RNG_STREAM_IMPACT 2
+
+typedef struct rng_t {
+	uint4 counter; //id, frame, draw, stream
+	uint2 key;
+	float4 lanes; //Last round, lanes from used on are not handed out yet
+	uint used;
+} rng_t;
+
+rng_t rng_init(const uint id, const uint frame, const uint seed, const uint stream) {
+	rng_t rng;
+	rng.counter = (uint4)(id, frame, 0, stream);
+	rng.key = (uint2)(seed, 0xCA01F9DD);
+	rng.lanes = (float4)(0.f);
+	rng.used = 4;
+	return rng;
 }
 
-//Set dual to true to get a number in range -m..m (otherwise 0..m)
-float _random1(const float m, const bool dual, uint *time, const uint id, __global const float * const rnd, const int max_num_particles) {
-	return random(time, id, rnd, max_num_particles)*m*(1+dual) - m*dual;
+uint4 philox4x32_round(const uint4 ctr, const uint2 key) {
+	const uint M0 = 0xD2511F53;
+	const uint M1 = 0xCD9E8D57;
+	return (uint4)(
+			mul_hi(M1, ctr.z) ^ ctr.y ^ key.x,
+			M1 * ctr.z,
+			mul_hi(M0, ctr.x) ^ ctr.w ^ key.y,
+			M0 * ctr.x
+			);
+}
+
+uint4 philox4x32_10(uint4 ctr, uint2 key) {
+	const uint2 weyl = (uint2)(0x9E3779B9, 0xBB67AE85);
+	for(int i=0; i < 9; ++i) {
+		ctr = philox4x32_round(ctr, key);
+		key += weyl;
+	}
+	return philox4x32_round(ctr, key);
 }
 
-float4 _random4(const float4 m, const bool dual, uint *time, const uint id, __global const float * const rnd, const int max_num_particles) {
-	return (float4) (
-								 _random1(m.x, dual, time, id, rnd, max_num_particles),
-								 _random1(m.y, dual, time, id, rnd, max_num_particles),
-								 _random1(m.z, dual, time, id, rnd, max_num_particles),
-								 _random1(m.w, dual, time, id, rnd, max_num_particles)
-								 );
+//Four numbers in range 0..1, the next call gives four new ones
+float4 random_uniform4(rng_t *rng) {
+	const uint4 r = philox4x32_10(rng->counter, rng->key);
+	rng->counter.z++;
+	//24 bits is all a float can hold in 0..1
+	return convert_float4(r >> 8) * (1.f / 16777216.f);
 }
 
-float3 _random3(const float3 m, const bool dual, uint *time, const int id, __global const float * const rnd, const int max_num_particles) {
-	return (float3) (
-								 _random1(m.x, dual, time, id, rnd, max_num_particles),
-								 _random1(m.y, dual, time, id, rnd, max_num_particles),
-								 _random1(m.z, dual, time, id, rnd, max_num_particles)
-								 );
+//One number in range 0..1, from the lanes of the last round
+float random_uniform1(rng_t *rng) {
+	if(rng->used == 4) {
+		rng->lanes = random_uniform4(rng);
+		rng->used = 0;
+	}
+	const uint i = rng->used++;
+	return i == 0 ? rng->lanes.x : (i == 1 ? rng->lanes.y : (i == 2 ? rng->lanes.z : rng->lanes.w));
 }
 
-#define random1(m, dual) _random1((m), (dual), &time, id, rnd, config->max_num_particles)
-#define random3(m, dual) _random3((m), (dual), &time, id, rnd, config->max_num_particles)
-#define random4(m, dual) _random4((m), (dual), &time, id, rnd, config->max_num_particles)
+//Set dual to true to get a number in range -m..m (otherwise 0..m)
+float _random1(const float m, const bool dual, rng_t *rng) {
+	return random_uniform1(rng)*m*(1+dual) - m*dual;
+}
+
+//A round of its own, the lanes are left for _random1 and _random3
+float4 _random4(const float4 m, const bool dual, rng_t *rng) {
+	return random_uniform4(rng)*m*(1+dual) - m*dual;
+}
+
+float3 _random3(const float3 m, const bool dual, rng_t *rng) {
+	//Drawn in order, the arguments of a vector literal may be evaluated in any
+	float3 r;
+	r.x = random_uniform1(rng);
+	r.y = random_uniform1(rng);
+	r.z = random_uniform1(rng);
+	return r*m*(1+dual) - m*dual;
+}
 
+//The kernels declare rng_t rng with rng_init first
+#define random1(m, dual) _random1((m), (dual), &rng)
+#define random3(m, dual) _random3((m), (dual), &rng)
+#define random4(m, dual) _random4((m), (dual), &rng)
 
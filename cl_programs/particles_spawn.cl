@@ -0,0 +1,244 @@
+//Shared by particles.cl and hitting_particles.cl, include after particles_structs.cl and particles_random.cl
+
+//The emitter owning particle id, there are only a few of them
+int emitter_index(__constant const emitter_t * emitters, uint num_emitters, uint id) {
+	int e = 0;
+	while(e + 1 < num_emitters && emitters[e + 1].first <= id) ++e;
+	return e;
+}
+
+/*
+ * CLParticleBackend compiles out the terms no config of the world needs, by defining
+ * NO_GRAVITY, NO_WIND, NO_MOTION_RAND, NO_ROTATION, NO_LOD, NO_GROUND and NO_TURBULENCE
+ */
+
+//Distant particles are only run every lod_step frames, with lod_step * dt
+uint lod_step(__constant const config_t * config, float distance) {
+#ifdef NO_LOD
+	return 1;
+#endif
+	if(config->lod_distances.y > 0 && distance > config->lod_distances.y) return 4;
+	if(config->lod_distances.x > 0 && distance > config->lod_distances.x) return 2;
+	return 1;
+}
+
+//Particles past the fog keep their birth color and initial scale
+bool lod_interpolate(__constant const config_t * config, float distance) {
+#ifdef NO_LOD
+	return true;
+#endif
+	return config->lod_distances.z <= 0 || distance < config->lod_distances.z;
+}
+
+//Trilinear sample of the turbulence field, p in cells. The field tiles
+float3 turbulence_at(__global const float4 * field, const float3 p) {
+	const float3 f = floor(p);
+	const float3 d = p - f;
+	const int3 c0 = convert_int3(f) & (TURBULENCE_SIZE - 1);
+	const int3 c1 = (c0 + 1) & (TURBULENCE_SIZE - 1);
+
+#define FIELD(x, y, z) field[((z) * TURBULENCE_SIZE + (y)) * TURBULENCE_SIZE + (x)].xyz
+	const float3 y0 = mix(mix(FIELD(c0.x, c0.y, c0.z), FIELD(c1.x, c0.y, c0.z), d.x), mix(FIELD(c0.x, c1.y, c0.z), FIELD(c1.x, c1.y, c0.z), d.x), d.y);
+	const float3 y1 = mix(mix(FIELD(c0.x, c0.y, c1.z), FIELD(c1.x, c0.y, c1.z), d.x), mix(FIELD(c0.x, c1.y, c1.z), FIELD(c1.x, c1.y, c1.z), d.x), d.y);
+#undef FIELD
+	return mix(y0, y1, d.z);
+}
+
+/*
+ * Advance velocity and position of a live particle dt seconds.
+ * turbulence_offset: xyz is added to the position before sampling the field, w is field cells per world unit
+ */
+void integrate_particle(__constant const config_t * config, __global const particle_t * particle, __global float4 * velocity, float4 * position, const float dt, rng_t * rng,
+		__global const float4 * turbulence, const float4 turbulence_offset) {
+	float4 v = *velocity;
+#ifndef NO_GRAVITY
+	v.xyz += config->gravity.xyz * load_half(particle->gravity_influence) * dt;
+#endif
+#ifndef NO_WIND
+	v.xyz -= (v.xyz - config->wind_velocity.xyz) * load_half(particle->wind_influence) * dt;
+#endif
+#if !defined(NO_GRAVITY) || !defined(NO_WIND)
+	*velocity = v;
+#endif
+
+#ifdef NO_MOTION_RAND
+	position->xyz += v.xyz * dt;
+#else
+	position->xyz += (v.xyz + _random3(config->motion_rand.xyz, true, rng)) * dt;
+#endif
+#ifndef NO_ROTATION
+	position->w += v.w * dt;
+#endif
+
+	//Coherent motion, carried along by the field instead of accelerated
+#ifndef NO_TURBULENCE
+	if(config->turbulence.x != 0) {
+		position->xyz += turbulence_at(turbulence, (position->xyz + turbulence_offset.xyz) * turbulence_offset.w) * config->turbulence.x * dt;
+	}
+#endif
+}
+
+//Height of the terrain at xz, same as Terrain::height_at. 0 outside of it
+float ground_height(__global const float * heights, const int2 size, const float scale, const float2 xz) {
+	const float2 p = xz / scale;
+	if(p.x < 0 || p.y < 0 || p.x > size.x || p.y > size.y) return 0.f;
+
+	const int2 c = min(convert_int2(p), size - 2);
+	const float2 d = clamp(p - convert_float2(c), 0.f, 1.f);
+	const int i = c.y * size.x + c.x;
+	return mix(mix(heights[i], heights[i + 1], d.x), mix(heights[i + size.x], heights[i + size.x + 1], d.x), d.y);
+}
+
+//Ground contact of a particle that just moved, see config_t::ground. Returns false if the ground kills it
+bool collide_ground(__constant const config_t * config, __global const float * heights, const int2 size, const float scale, float4 * position, __global float4 * velocity) {
+#ifdef NO_GROUND
+	return true;
+#else
+	const int response = (int) config->ground.x;
+	if(response == GROUND_NONE || size.x < 2 || size.y < 2) return true;
+
+	const float h = ground_height(heights, size, scale, position->xz);
+	if(position->y >= h) return true;
+	if(response == GROUND_KILL) return false;
+
+	position->y = h;
+	float4 v = *velocity;
+	if(response == GROUND_STICK) {
+		v.xyz = (float3)(0.f);
+	} else {
+		//Reflect off the slope, ground.y is the restitution
+		const float2 dx = (float2)(scale, 0.f);
+		const float2 dz = (float2)(0.f, scale);
+		const float3 n = normalize((float3)(
+					ground_height(heights, size, scale, position->xz - dx) - ground_height(heights, size, scale, position->xz + dx),
+					2.f * scale,
+					ground_height(heights, size, scale, position->xz - dz) - ground_height(heights, size, scale, position->xz + dz)));
+		const float vn = dot(v.xyz, n);
+		if(vn < 0) v.xyz -= (1.f + config->ground.y) * vn * n;
+	}
+	*velocity = v;
+	return true;
+#endif
+}
+
+//Return a dead particle to the free list of its emitter
+void free_particle(__constant const emitter_t * emitter, int e, __global int * free_list, __global int * free_counts, uint id) {
+	free_list[emitter->first + atomic_inc(&free_counts[e])] = id - emitter->first;
+}
+
+//Give particle id the state of a newly spawned particle of config, around origin
+void init_particle(__global float4 * positions, __global float4 * velocities, __global particle_t * particles,
+		__global const config_t * config, const float3 origin, const uchar palette_index, const uint id, rng_t * rng) {
+	float4 position;
+	position.xyz = origin + _random3(config->spawn_area.xyz, false, rng);
+
+	float a = _random1(2*M_PI, false, rng);
+	float a2 = _random1(2*M_PI, false, rng);
+	float len = _random1(config->spawn_area.w, false, rng);
+	position.x += len * cos(a);
+	position.y += len * sin(a);
+	position.z += len * sin(a) * cos(a2);
+	position.w = 0.f;
+	positions[id] = position;
+
+	//Colors are looked up in the palette to allow changing config during runtime
+	particles[id].palette_index = palette_index;
+	particles[id].texture_index = config->start_texture + (int)floor(_random1((float)(config->num_textures-0.1), false, rng));
+
+	store_half(config->avg_wind_influence + _random1(config->wind_influence_var, true, rng), particles[id].wind_influence);
+	store_half(config->avg_gravity_influence + _random1(config->gravity_influence_var, true, rng), particles[id].gravity_influence);
+
+	velocities[id] = (float4)(config->avg_spawn_velocity.xyz + _random3(config->spawn_velocity_var.xyz, true, rng), config->avg_rotation_speed + _random1(config->rotation_speed_var, true, rng));
+
+	//Must be alive to be run, and later freed
+	store_half(fmax(config->avg_ttl + _random1(config->ttl_var, true, rng), 0.001f), particles[id].org_ttl);
+	particles[id].ttl = load_half(particles[id].org_ttl);
+
+	float initial_scale = config->avg_scale + _random1(config->scale_var, true, rng);
+	store_half(initial_scale, particles[id].initial_scale);
+	store_half(initial_scale + config->avg_scale_change + _random1(config->scale_change_var, true, rng), particles[id].final_scale);
+}
+
+__kernel void spawn_particles (
+														 __global float4 * positions,
+														 __global float4 * velocities,
+														 __global particle_t * particles,
+														 __constant emitter_t * emitters,
+														 __global const config_t * spawn_configs, //Configs referenced by requests
+														 uint seed, //Key of the random streams
+														 __global const int * free_list, //Indices of dead particles, each emitter has its own range
+														 __global int * free_counts, //Number of entries in free_list per emitter, use atomic operations!
+														 __global const spawn_request_t * requests, //Sorted by offset
+														 uint num_requests,
+														 uint frame //Update counter, part of the random counter
+														 )
+{
+	//Find our request: the last one starting at or before us
+	uint gid = get_global_id(0);
+	uint lo = 0, hi = num_requests - 1;
+	while(lo < hi) {
+		uint mid = (lo + hi + 1) / 2;
+		if(requests[mid].offset <= gid) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	__global const config_t * config = &spawn_configs[requests[lo].config_index];
+	int e = requests[lo].emitter;
+
+	//One work-item per particle to spawn, pop a dead slot from the free list of the emitter
+	int slot = atomic_dec(&free_counts[e]) - 1;
+	if(slot < 0) {
+		//Emitter is full, undo the pop
+		atomic_inc(&free_counts[e]);
+		return;
+	}
+
+	uint id = emitters[e].first + free_list[emitters[e].first + slot];
+	rng_t rng = rng_init(id, frame, seed, RNG_STREAM_SPAWN);
+	init_particle(positions, velocities, particles, config, config->spawn_position.xyz, requests[lo].palette_index, id, &rng);
+}
+
+/*
+ * The kernels below are run by the host when it resizes the range of an emitter (see CLParticleBackend::apply_layout).
+ * first is where the range of emitter e starts in the given buffers, one work-item per particle from begin.
+ */
+
+//Push the dead particles to the free list of e. With clear the range is new and all of it is dead
+__kernel void free_range (
+														 __global particle_t * particles,
+														 __global int * free_list,
+														 __global int * free_counts,
+														 int e,
+														 int first,
+														 int begin,
+														 uint clear
+														 )
+{
+	int i = begin + get_global_id(0);
+	if(clear) particles[first + i].ttl = 0.f;
+	if(particles[first + i].ttl <= 0) free_list[first + atomic_inc(&free_counts[e])] = i;
+}
+
+//Move the live particles from begin and up to slots popped from the free list of e, before the range is cut at begin.
+//The free list must hold at least as many slots below begin as there are live particles to move
+__kernel void move_range (
+														 __global float4 * positions,
+														 __global float4 * velocities,
+														 __global particle_t * particles,
+														 __global const int * free_list,
+														 __global int * free_counts,
+														 int e,
+														 int first,
+														 int begin
+														 )
+{
+	int from = first + begin + get_global_id(0);
+	if(particles[from].ttl <= 0) return;
+
+	int to = first + free_list[first + atomic_dec(&free_counts[e]) - 1];
+	positions[to] = positions[from];
+	velocities[to] = velocities[from];
+	particles[to] = particles[from];
+}
@@ -2,35 +2,48 @@
 	#define M_PI 3.14159
 #endif
 
+//Half floats are stored as ushort, use these to access them in global memory
+#define load_half(field) vload_half(0, (__global const half*) &(field))
+#define store_half(value, field) vstore_half((value), 0, (__global half*) &(field))
+
+/*
+ * Particle state besides position and velocity, these are kept in their own float4 buffers:
+ * position: xyz and rotation, velocity: xyz and rotation speed.
+ * A particle is alive while ttl > 0
+ */
 typedef struct particle_t {
-	float3 velocity;
-	
 	float ttl;
-	float rotation_speed;
-	float initial_scale;
-	float final_scale;
+	ushort org_ttl; //half, original time to live, stored to get a percentage
+	ushort initial_scale; //half
+	ushort final_scale; //half
+	ushort wind_influence; //half
+	ushort gravity_influence; //half
+	uchar texture_index;
+	uchar palette_index; //Colors and damage
+} particle_t;
 
-	float wind_influence;
-	float gravity_influence;
-	float org_ttl; //original time to live, stored to get a percentage
-	int dead;
+typedef struct vertex_t {
+	float position[4]; //w is rotation
+	uchar4 color;
+	ushort scale; //half
+	ushort texture_index;
+} vertex_t;
 
+//Shared by all particles spawned with the same colors
+typedef struct palette_entry_t {
 	float4 birth_color;
 	float4 death_color;
+	float damage;
+} palette_entry_t;
 
-	//Oh, herro hack.
-	int extra1;
-	int extra2;
-	float extra3;
-	float extra4;
-} particle_t __attribute__ ((aligned (16))) ;
+//Cells along each side of the tiling turbulence field, must be same as ParticleBackend::TURBULENCE_SIZE
+#define TURBULENCE_SIZE 32
 
-typedef struct vertex_t {
-	float4 position;
-	float4 color;
-	float scale;
-	int texture_index;
-} vertex_t __attribute__ ((aligned (16))) ;
+//Must be same as ParticleSystem::ground_response_t
+#define GROUND_NONE 0
+#define GROUND_KILL 1
+#define GROUND_BOUNCE 2
+#define GROUND_STICK 3
 
 typedef struct config_t {
 	float avg_ttl;
@@ -67,4 +80,47 @@ typedef struct config_t {
 	float4 wind_velocity;	//Speed
 	float4 gravity;			//Acceleration
 
+	float4 lod_camera; //xyz, the distances below are measured from here
+	float4 lod_distances; //Beyond x run every 2nd frame, beyond y every 4th, beyond z no color/scale interpolation. 0 disables
+
+	float4 ground; //x: response to the terrain, one of GROUND_*, y: restitution of GROUND_BOUNCE
+	float4 turbulence; //x: velocity added by the turbulence field at full strength
+
 } config_t __attribute__ ((aligned (16))) ;
+
+typedef struct spawn_request_t {
+	int config_index;
+	int count;
+	int offset; //Sum of count of all previous requests
+	uchar palette_index;
+	uchar emitter;
+	ushort padding;
+} spawn_request_t;
+
+/*
+ * A range of the pool owned by one emitter, with its own part of the free list.
+ * The free list holds indices relative to first, so a range can be moved with a plain copy.
+ * The emitters are sorted by first and first is a multiple of four.
+ */
+typedef struct emitter_t {
+	int first;
+	int count; //Current size of the range, resized by the host between updates
+	int hit_test; //Only used by hitting_particles.cl
+	int max_count; //Only used by the host
+} emitter_t;
+
+//Same layout as the arguments of glDrawArraysIndirect
+typedef struct draw_args_t {
+	uint count;
+	uint instance_count;
+	uint first;
+	uint base_instance;
+} draw_args_t;
+
+//Must match the host structs (see the static_asserts in particle_backend.hpp)
+typedef char check_particle_size[sizeof(particle_t) == 16 ? 1 : -1];
+typedef char check_vertex_size[sizeof(vertex_t) == 24 ? 1 : -1];
+typedef char check_palette_entry_size[sizeof(palette_entry_t) == 48 ? 1 : -1];
+typedef char check_config_size[sizeof(config_t) == 272 ? 1 : -1];
+typedef char check_spawn_request_size[sizeof(spawn_request_t) == 16 ? 1 : -1];
+typedef char check_emitter_size[sizeof(emitter_t) == 16 ? 1 : -1];
@@ -0,0 +1,76 @@
+#version 150
+
+#include "uniforms.glsl"
+
+/*
+ * Dust motes without any vertex data, see Dust.
+ * Vertex i is the mote in cell i of a lattice of num_cells around the camera.
+ * The lattice drifts with the wind and each mote is reborn at a new place in its cell when its ttl runs out.
+ */
+
+uniform ivec3 num_cells;
+uniform float cell_size;
+uniform vec3 drift; //How far the wind has carried the dust
+
+uniform vec4 birth_color;
+uniform vec4 death_color;
+uniform vec2 ttl; //avg, var
+uniform vec2 scale; //avg, var
+uniform vec2 scale_change; //avg, var
+uniform vec2 rotation_speed; //avg, var
+uniform vec3 motion_rand;
+uniform ivec2 textures; //start, num
+
+out ParticleData {
+	vec4 color;
+	float scale;
+	float rotation;
+	int texture_index;
+} particleData;
+
+//Four numbers in range 0..1 for a cell and seed (pcg4d, Jarzynski and Olano 2020)
+vec4 hash(ivec3 cell, int seed) {
+	uvec4 v = uvec4(uvec3(cell), uint(seed)) * 1664525u + 1013904223u;
+	v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
+	v ^= v >> 16u;
+	v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
+	return vec4(v >> 8u) * (1.0 / 16777216.0);
+}
+
+//avg_var.x +- avg_var.y from r in range 0..1
+float vary(vec2 avg_var, float r) {
+	return avg_var.x + avg_var.y * (2.0 * r - 1.0);
+}
+
+void main() {
+	ivec3 i = ivec3(gl_VertexID % num_cells.x, (gl_VertexID / num_cells.x) % num_cells.y, gl_VertexID / (num_cells.x * num_cells.y));
+
+	//The lattice moves with the dust, draw the part around the camera
+	vec3 lattice_camera = (camera_pos - drift) / cell_size;
+	ivec3 cell = ivec3(floor(lattice_camera)) - num_cells / 2 + i;
+
+	//Same for all lives of the mote
+	vec4 h = hash(cell, 0);
+	float mote_ttl = max(vary(ttl, h.x), 0.001);
+	float age = state.time / mote_ttl + h.y;
+	float life_progression = fract(age);
+
+	//New for each life
+	int generation = int(floor(age));
+	vec4 r = hash(cell, 2 * generation + 1);
+	vec4 r2 = hash(cell, 2 * generation + 2);
+
+	vec3 position = (vec3(cell) + r.xyz) * cell_size + drift + motion_rand * sin(state.time + 6.2832 * r2.xyz);
+
+	float initial_scale = vary(scale, r.w);
+	particleData.scale = initial_scale + vary(scale_change, h.z) * life_progression;
+	particleData.rotation = vary(rotation_speed, r2.w) * life_progression * mote_ttl;
+	particleData.texture_index = textures.x + int(h.w * (float(textures.y) - 0.1));
+
+	//Fade out towards the edges of the lattice, where motes pop in and out as the camera moves
+	vec3 edge = abs(position - camera_pos) / (vec3(num_cells) * 0.5 * cell_size);
+	particleData.color = mix(birth_color, death_color, life_progression);
+	particleData.color.a *= 1.0 - smoothstep(0.7, 1.0, max(edge.x, max(edge.y, edge.z)));
+
+	gl_Position = viewMatrix * vec4(position, 1.0);
+}
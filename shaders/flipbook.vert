@@ -0,0 +1,25 @@
+#version 150
+#extension GL_ARB_explicit_attrib_location: enable
+
+#include "uniforms.glsl"
+
+/*
+ * One explosion of ExplosionFlipbooks
+ */
+
+layout (location = 0) in vec4 position; //w is half size
+layout (location = 1) in vec2 frame_rotation; //x is layer, its fraction blends to the next
+
+out FlipbookData {
+	float size;
+	float frame;
+	float rotation;
+} flipbookData;
+
+void main() {
+	flipbookData.size = position.w;
+	flipbookData.frame = frame_rotation.x;
+	flipbookData.rotation = frame_rotation.y;
+
+	gl_Position = viewMatrix * modelMatrix * vec4(position.xyz, 1.0);
+}
@@ -0,0 +1 @@
+#include "particles.vert"
@@ -3,8 +3,9 @@
 
 #include "uniforms.glsl"
 
-layout (location = 0) in float life;
-layout (location = 1) in float scale;
+layout (location = 0) in vec3 in_position;
+layout (location = 1) in float life;
+layout (location = 2) in float scale;
 
 out BarData {
 	vec4 color;
@@ -12,11 +13,9 @@ out BarData {
 } barData;
 
 void main() {
-	vec4 pos = modelMatrix * vec4(0, 1.0, 0, 1);
-
 	barData.scale = scale;
 
-	gl_Position = viewMatrix * pos;
+	gl_Position = viewMatrix * vec4(in_position, 1.0);
 
 	barData.color = mix(vec4(1, 0, 0, 1), vec4(0, 1, 0, 1), life);
 }
@@ -0,0 +1 @@
+#include "normal.frag"
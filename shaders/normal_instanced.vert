@@ -0,0 +1,39 @@
+#version 150
+#extension GL_ARB_explicit_attrib_location: enable
+
+#include "uniforms.glsl"
+
+/*
+ * normal.vert for InstancedModels, the transform of the instance is applied after modelMatrix.
+ * Instances are scaled uniformly, so the rotation of the instance is enough for the normals
+ */
+
+layout (location = 0) in vec4 in_position;
+layout (location = 1) in vec2 in_texcoord;
+layout (location = 2) in vec4 in_normal;
+layout (location = 3) in vec4 in_tangent;
+layout (location = 4) in vec4 in_bitangent;
+layout (location = 5) in vec4 in_color;
+layout (location = 6) in mat4 in_instance_matrix;
+
+out vec3 position;
+out vec3 normal;
+out vec3 tangent;
+out vec3 bitangent;
+out vec2 texcoord;
+out vec4 shadowmap_coord[maxNumberOfLights];
+
+void main() {
+   vec4 w_pos = in_instance_matrix * (modelMatrix * in_position);
+   mat3 instance_rotation = mat3(in_instance_matrix);
+   position = w_pos.xyz;
+   gl_Position = projectionViewMatrix *  w_pos;
+   texcoord = in_texcoord;
+   normal = instance_rotation * (normalMatrix * in_normal).xyz;
+   tangent = instance_rotation * (normalMatrix * in_tangent).xyz;
+   bitangent = instance_rotation * (normalMatrix * in_bitangent).xyz;
+
+	for(int i=0; i < Lgt.num_lights; ++i) {
+		shadowmap_coord[i] = Lgt.lights[i].matrix * w_pos;
+	}
+}
@@ -0,0 +1 @@
+#include "passthru.frag"
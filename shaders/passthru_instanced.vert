@@ -0,0 +1,18 @@
+#version 330
+#extension GL_ARB_explicit_attrib_location: enable
+
+#include "uniforms.glsl"
+
+//passthru.vert for InstancedModels
+
+layout (location=0) in vec4 in_pos;
+layout (location=1) in vec2 in_uv;
+layout (location=6) in mat4 in_instance_matrix;
+
+out vec2 uv;
+
+void main(){
+	uv = in_uv;
+	vec4 w_pos = in_instance_matrix * (modelMatrix * in_pos);
+	gl_Position = projectionViewMatrix *  w_pos;
+}
@@ -11,39 +11,41 @@
 #include <GL/glx.h>
 #endif
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
 #include <sstream>
 
 #define PP_INCLUDE "#include"
 
+//First bytes of a program binary cache file, change the version when the layout changes
+static const char cache_magic[8] = { 'D', 'S', 'C', 'L', 'B', 'I', 'N', '1' };
+
 extern FILE* verbose; /* because globals.hpp fails due to libX11 containing Time which collides with our Time class */
 std::map<std::string, cl::Program> CL::cache;
 
+static CL_API_ENTRY cl_event (CL_API_CALL
+*clCreateEventFromGLsyncKHR)(cl_context context,
+                             cl_GLsync sync,
+                             cl_int *errcode_ret)=NULL;
 
-CL::CL() {
-	cl_int err;
-
-	std::vector<cl::Platform> platforms;
-	if(cl::Platform::get(&platforms) == CL_INVALID_VALUE) {
-		fprintf(stderr, "[OpenCL] No platforms available\n");
-		util_abort();
-	}
 
-	platform_ = platforms[0]; //Just select the first platform
-
-	std::string name, version, extensions;
-
-	platform_.getInfo(CL_PLATFORM_NAME, &name);
-	platform_.getInfo(CL_PLATFORM_VERSION, &version);
-	platform_.getInfo(CL_PLATFORM_EXTENSIONS, &extensions);
-
-	fprintf(verbose, "[OpenCL] Platform: %s %s\n"
-	        "  Extensions: %s\n", name.c_str(), version.c_str() ,extensions.c_str());
+static CL_API_ENTRY cl_int (CL_API_CALL
+*clGetGLContextInfoKHR)(const cl_context_properties *properties,
+													cl_gl_context_info param_name,
+													size_t param_value_size,
+													void *param_value,
+													size_t *param_value_size_ret)=NULL;
 
+/*
+ * Context properties for sharing objects with the current gl context on platform
+ */
+static std::vector<cl_context_properties> gl_context_properties(const cl::Platform &platform) {
 #if defined (__APPLE__) || defined(MACOSX)
 	CGLContextObj kCGLContext = CGLGetCurrentContext();
 	CGLShareGroupObj kCGLShareGroup = CGLGetShareGroup(kCGLContext);
-	cl_context_properties properties[] =
-	{
+	return std::vector<cl_context_properties> {
 		CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE, (cl_context_properties)kCGLShareGroup,
 		0
 	};
@@ -55,119 +57,181 @@ CL::CL() {
 		util_abort();
 	}
 
-	cl_context_properties properties[] = {
-		CL_CONTEXT_PLATFORM, (cl_context_properties)platform_(),
+	return std::vector<cl_context_properties> {
+		CL_CONTEXT_PLATFORM, (cl_context_properties)platform(),
 		CL_WGL_HDC_KHR, (intptr_t) current_dc,
 		CL_GL_CONTEXT_KHR, (intptr_t) current_context,
 		0
 	};
-
 #else
 	if(glXGetCurrentContext() == NULL) {
 		fprintf(stderr, "[OpenCL] glXGetCurrentContex() return NULL. Make sure to create OpenGL context before create the CL-context\n");
 		util_abort();
 	}
-	cl_context_properties properties[] =
-	{
+	return std::vector<cl_context_properties> {
 		CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(),
 		CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(),
-		CL_CONTEXT_PLATFORM, (cl_context_properties)(platform_)(),
+		CL_CONTEXT_PLATFORM, (cl_context_properties)platform(),
 		0
 	};
 #endif
+}
 
-	
-	static CL_API_ENTRY cl_int (CL_API_CALL
-	*clGetGLContextInfoKHR)(const cl_context_properties *properties,
-														cl_gl_context_info param_name,
-														size_t param_value_size,
-														void *param_value,
-														size_t *param_value_size_ret)=NULL;
+/*
+ * Case insensitive search for pattern in str
+ */
+static bool contains(std::string str, std::string pattern) {
+	std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+	std::transform(pattern.begin(), pattern.end(), pattern.begin(), ::tolower);
+	return str.find(pattern) != std::string::npos;
+}
 
-	clGetGLContextInfoKHR = (clGetGLContextInfoKHR_fn) clGetExtensionFunctionAddress("clGetGLContextInfoKHR");
+static const char * device_type_name(cl_device_type type) {
+	if(type & CL_DEVICE_TYPE_GPU) return "GPU";
+	if(type & CL_DEVICE_TYPE_ACCELERATOR) return "Accelerator";
+	if(type & CL_DEVICE_TYPE_CPU) return "CPU";
+	return "Other";
+}
 
-	cl_device_id devices[32];
-	size_t deviceSize = 0;
-	err = clGetGLContextInfoKHR(properties, 
-									CL_DEVICES_FOR_GL_CONTEXT_KHR,
-									32 * sizeof(cl_device_id), 
-									devices, 
-									&deviceSize);
+/*
+ * True if device matches the device setting: auto, a type (gpu, cpu or accelerator) or part of the name
+ */
+static bool device_matches(const std::string &pattern, const std::string &name, cl_device_type type) {
+	if(pattern == "auto") return true;
+	if(pattern == "gpu") return (type & CL_DEVICE_TYPE_GPU) != 0;
+	if(pattern == "cpu") return (type & CL_DEVICE_TYPE_CPU) != 0;
+	if(pattern == "accelerator") return (type & CL_DEVICE_TYPE_ACCELERATOR) != 0;
+	return contains(name, pattern);
+}
 
-	if(deviceSize == 0) {
-		fprintf(stderr, "[OpenCL] Interop not possible\n");
-		util_abort();
+CL::CL(const std::string &platform_name, const std::string &device_name) : gl_sharing_(false), gl_event_support_(false), available_(false) {
+	cl_int err;
+
+	std::vector<cl::Platform> platforms;
+	if(cl::Platform::get(&platforms) != CL_SUCCESS || platforms.empty()) {
+		fprintf(stderr, "[OpenCL] No platforms available\n");
+		return;
 	}
 
-	
-	
-	cl_bool image_support, available;
-	size_t max_width, max_height;
-	cl_uint num_cores, frequency;
-	cl_device_type _type;
-	std::string type;
+	clGetGLContextInfoKHR = (clGetGLContextInfoKHR_fn) clGetExtensionFunctionAddress("clGetGLContextInfoKHR");
+	if(clGetGLContextInfoKHR == NULL) {
+		fprintf(stderr, "[OpenCL] cl_khr_gl_sharing not supported, particles are copied to opengl\n");
+	}
 
+	/*
+	 * Rank all matching devices, best first:
+	 * Sharing objects with gl, running the gl context, GPU before accelerator before CPU, and last cores * frequency
+	 */
+	struct candidate_t {
+		cl::Platform platform;
+		cl::Device device;
+		bool gl_sharing;
+		int rank;
+		cl_ulong speed;
+	};
+	std::vector<candidate_t> candidates;
+
+	std::string name, version, extensions;
 	fprintf(verbose, "[OpenCL] Available devices: \n");
 
-	for(int i=0; i< (deviceSize / sizeof(cl_device_id)); ++i) {
-		cl::Device device(devices[i]);
-		device.getInfo(CL_DEVICE_VENDOR, &name);
-		device.getInfo(CL_DEVICE_VERSION, &version);
-		device.getInfo(CL_DEVICE_EXTENSIONS, &extensions);
-		device.getInfo(CL_DEVICE_AVAILABLE, &available);
-		device.getInfo(CL_DEVICE_IMAGE_SUPPORT, &image_support);
-		device.getInfo(CL_DEVICE_IMAGE2D_MAX_WIDTH, &max_width);
-		device.getInfo(CL_DEVICE_IMAGE2D_MAX_HEIGHT, &max_height);
-		device.getInfo( CL_DEVICE_MAX_COMPUTE_UNITS , &num_cores);
-		device.getInfo(CL_DEVICE_MAX_CLOCK_FREQUENCY, &frequency);
-		device.getInfo(CL_DEVICE_TYPE, &_type);
-
-		switch(_type) {
-			case CL_DEVICE_TYPE_GPU:
-				type = "GPU";
-				break;
-			case CL_DEVICE_TYPE_CPU:
-				type = "CPU";
-				break;
-			case CL_DEVICE_TYPE_ACCELERATOR:
-				type =  "Accelerator";
-				break;
+	for(cl::Platform &platform : platforms) {
+		platform.getInfo(CL_PLATFORM_NAME, &name);
+		platform.getInfo(CL_PLATFORM_VERSION, &version);
+		platform.getInfo(CL_PLATFORM_EXTENSIONS, &extensions);
+
+		fprintf(verbose, "[OpenCL] Platform: %s %s\n"
+		        "  Extensions: %s\n", name.c_str(), version.c_str() ,extensions.c_str());
+
+		if(platform_name != "auto" && !contains(name, platform_name)) continue;
+
+		//Devices that can share objects with the current gl context
+		cl_device_id gl_devices[32];
+		size_t gl_devices_size = 0;
+		cl_device_id gl_current_device = NULL;
+		if(clGetGLContextInfoKHR != NULL) {
+			std::vector<cl_context_properties> properties = gl_context_properties(platform);
+			if(clGetGLContextInfoKHR(&properties[0], CL_DEVICES_FOR_GL_CONTEXT_KHR, sizeof(gl_devices), gl_devices, &gl_devices_size) != CL_SUCCESS) {
+				gl_devices_size = 0;
+			}
+			clGetGLContextInfoKHR(&properties[0], CL_CURRENT_DEVICE_FOR_GL_CONTEXT_KHR, sizeof(gl_current_device), &gl_current_device, NULL);
 		}
 
-		fprintf(verbose, "[OpenCL] Device (%p): %s %s (%s)\n"
-				"		Cores: %u, Frequency: %u MHz, Available: %s,"
-				"		Image support: %s, max size: %lux%lu\n"
-				"		Extensions: %s\n --- \n", (device)(),  name.c_str(), version.c_str(), type.c_str(), num_cores, frequency,available?"YES":"NO",image_support?"YES":"NO", max_width, max_height, extensions.c_str());
-		devices_.push_back(device);
+		std::vector<cl::Device> devices;
+		if(platform.getDevices(CL_DEVICE_TYPE_ALL, &devices) != CL_SUCCESS) continue;
+
+		for(cl::Device &device : devices) {
+			cl_bool available;
+			cl_uint num_cores, frequency;
+			cl_device_type type;
+			device.getInfo(CL_DEVICE_NAME, &name);
+			device.getInfo(CL_DEVICE_VERSION, &version);
+			device.getInfo(CL_DEVICE_AVAILABLE, &available);
+			device.getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &num_cores);
+			device.getInfo(CL_DEVICE_MAX_CLOCK_FREQUENCY, &frequency);
+			device.getInfo(CL_DEVICE_TYPE, &type);
+
+			const bool gl_sharing = std::find(gl_devices, gl_devices + gl_devices_size / sizeof(cl_device_id), device()) != gl_devices + gl_devices_size / sizeof(cl_device_id);
+
+			fprintf(verbose, "[OpenCL] Device (%p): %s %s (%s)\n"
+					"		Cores: %u, Frequency: %u MHz, Available: %s, GL sharing: %s\n --- \n",
+					device(), name.c_str(), version.c_str(), device_type_name(type), num_cores, frequency, available?"YES":"NO", gl_sharing?"YES":"NO");
+
+			if(!available || !device_matches(device_name, name, type)) continue;
+
+			candidate_t c;
+			c.platform = platform;
+			c.device = device;
+			c.gl_sharing = gl_sharing;
+			c.rank = (gl_sharing ? 8 : 0) + (device() == gl_current_device ? 4 : 0)
+				+ ((type & CL_DEVICE_TYPE_GPU) ? 2 : (type & CL_DEVICE_TYPE_ACCELERATOR) ? 1 : 0);
+			c.speed = (cl_ulong) num_cores * frequency;
+			candidates.push_back(c);
+		}
 	}
-	
-	fprintf(verbose, "\n-------------------\n");
 
-	cl_device_id device_id;
+	fprintf(verbose, "\n-------------------\n");
 
+	if(candidates.empty()) {
+		fprintf(stderr, "[OpenCL] No device matches platform \"%s\" and device \"%s\"\n", platform_name.c_str(), device_name.c_str());
+		return;
+	}
 
-	context_ = cl::Context(devices_, properties, &CL::cl_error_callback, nullptr, &err);
+	const candidate_t &best = *std::max_element(candidates.begin(), candidates.end(), [](const candidate_t &a, const candidate_t &b) {
+		return a.rank < b.rank || (a.rank == b.rank && a.speed < b.speed);
+	});
 
+	platform_ = best.platform;
+	context_device_ = best.device;
+	devices_.push_back(context_device_);
+	gl_sharing_ = best.gl_sharing;
 
-	if(err != CL_SUCCESS) {
-		fprintf(stderr, "[OpenCL] Failed to create context: %s\n", errorString(err));
-		util_abort();
+	std::vector<cl_context_properties> properties;
+	if(gl_sharing_) {
+		properties = gl_context_properties(platform_);
+	} else {
+		properties = std::vector<cl_context_properties> { CL_CONTEXT_PLATFORM, (cl_context_properties)platform_(), 0 };
 	}
 
+	context_ = cl::Context(devices_, &properties[0], &CL::cl_error_callback, nullptr, &err);
 
-
-	err = clGetGLContextInfoKHR(properties, CL_CURRENT_DEVICE_FOR_GL_CONTEXT_KHR, sizeof(device_id), &device_id, NULL);
 	if(err != CL_SUCCESS) {
-		fprintf(stderr, "[OpenCL] Failed to get current device for context: %s\n", errorString(err));
+		fprintf(stderr, "[OpenCL] Failed to create context: %s\n", errorString(err));
 		util_abort();
 	}
 
-	context_device_ = cl::Device(device_id);
+	platform_.getInfo(CL_PLATFORM_NAME, &name);
+	context_device_.getInfo(CL_DEVICE_NAME, &version);
+	context_device_.getInfo(CL_DEVICE_EXTENSIONS, &extensions);
+	fprintf(verbose, "[OpenCL] Context Device (%p): %s on %s, GL sharing: %s\n", (context_device_)(), version.c_str(), name.c_str(), gl_sharing_ ? "YES" : "NO");
+	if(!gl_sharing_) {
+		fprintf(stderr, "[OpenCL] Using %s without sharing objects with opengl, particles are copied\n", version.c_str());
+	}
 
-	
-	context_device_.getInfo(CL_DEVICE_VENDOR, &name);
-	context_device_.getInfo(CL_DEVICE_VERSION, &version);
-		fprintf(verbose, "[OpenCL] Context Device (%p): %s %s\n",(context_device_)(),  name.c_str(), version.c_str());
+	if(gl_sharing_ && extensions.find("cl_khr_gl_event") != std::string::npos) {
+		clCreateEventFromGLsyncKHR = (cl_event (CL_API_CALL *)(cl_context, cl_GLsync, cl_int*)) clGetExtensionFunctionAddress("clCreateEventFromGLsyncKHR");
+		gl_event_support_ = (clCreateEventFromGLsyncKHR != NULL);
+	}
+	fprintf(verbose, "[OpenCL] GL event sharing: %s\n", gl_event_support_ ? "YES" : "NO");
 
 	queue_ = cl::CommandQueue(context_, context_device_, 0, &err);
 
@@ -175,6 +239,12 @@ CL::CL() {
 		fprintf(stderr, "[OpenCL] Failed to create a command queue: %s\n", errorString(err));
 		util_abort();
 	}
+
+	available_ = true;
+}
+
+bool CL::available() const {
+	return available_;
 }
 
 CL::~CL(){
@@ -242,26 +312,163 @@ std::string CL::parse_file(
 	return parsed_content.str();
 }
 
-cl::Program CL::create_program(const std::string &source_file) const{
-	auto it = cache.find(source_file);
+cl_ulong CL::program_key(const std::string &source, const std::string &options) const {
+	std::stringstream key;
+	std::string info;
+
+	platform_.getInfo(CL_PLATFORM_NAME, &info);
+	key << info << '\0';
+	platform_.getInfo(CL_PLATFORM_VERSION, &info);
+	key << info << '\0';
+
+	for(const cl::Device &device : devices_) {
+		device.getInfo(CL_DEVICE_NAME, &info);
+		key << info << '\0';
+		device.getInfo(CL_DEVICE_VERSION, &info);
+		key << info << '\0';
+		device.getInfo(CL_DRIVER_VERSION, &info);
+		key << info << '\0';
+	}
+
+	key << options << '\0' << source;
+
+	//FNV-1a
+	const std::string str = key.str();
+	cl_ulong hash = 14695981039346656037ULL;
+	for(const char c : str) {
+		hash ^= (unsigned char) c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+bool CL::load_program_binaries(const std::string &cache_file, cl_ulong key, const std::string &options, cl::Program &program) const {
+	Data * file = Data::open(cache_file);
+	if(file == nullptr) return false;
+
+	char magic[sizeof(cache_magic)];
+	cl_ulong file_key;
+	cl_uint num_binaries;
+
+	bool valid = file->read(magic, sizeof(magic), 1) == 1 && memcmp(magic, cache_magic, sizeof(magic)) == 0
+		&& file->read(&file_key, sizeof(file_key), 1) == 1 && file_key == key
+		&& file->read(&num_binaries, sizeof(num_binaries), 1) == 1 && num_binaries == devices_.size();
+
+	//One binary per device, in the order of devices_
+	std::vector<std::vector<char> > data;
+	cl::Program::Binaries binaries;
+	data.reserve(devices_.size()); //binaries points into data
+	for(cl_uint i=0; valid && i < num_binaries; ++i) {
+		cl_ulong size;
+		valid = file->read(&size, sizeof(size), 1) == 1 && size > 0 && size <= file->size();
+		if(!valid) break;
+		data.push_back(std::vector<char>(size));
+		valid = file->read(&data.back()[0], size, 1) == 1;
+		binaries.push_back(std::make_pair(&data.back()[0], (size_t) size));
+	}
+	delete file;
+
+	if(!valid) {
+		fprintf(verbose, "[OpenCL] Program cache %s is out of date\n", cache_file.c_str());
+		return false;
+	}
+
+	cl_int err;
+	std::vector<cl_int> status(devices_.size());
+	program = cl::Program(context_, devices_, binaries, &status, &err);
+	if(err == CL_SUCCESS) {
+		err = program.build(devices_, options.c_str());
+	}
+
+	if(err != CL_SUCCESS) {
+		fprintf(verbose, "[OpenCL] Failed to load program cache %s: %s\n", cache_file.c_str(), errorString(err));
+		return false;
+	}
+
+	return true;
+}
+
+void CL::save_program_binaries(const std::string &cache_file, cl_ulong key, const cl::Program &program) const {
+	std::vector<size_t> sizes;
+	cl_int err = program.getInfo(CL_PROGRAM_BINARY_SIZES, &sizes);
+	if(err != CL_SUCCESS || sizes.size() != devices_.size()) return;
+
+	std::vector<std::vector<unsigned char> > data;
+	std::vector<unsigned char*> pointers;
+	data.reserve(sizes.size()); //pointers points into data
+	for(size_t size : sizes) {
+		//Some devices don't give binaries, then there is nothing to cache
+		if(size == 0) return;
+		data.push_back(std::vector<unsigned char>(size));
+		pointers.push_back(&data.back()[0]);
+	}
+
+	err = clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(unsigned char*) * pointers.size(), &pointers[0], NULL);
+	if(err != CL_SUCCESS) {
+		fprintf(verbose, "[OpenCL] Failed to get program binaries: %s\n", errorString(err));
+		return;
+	}
+
+	//The cache is only an optimization, a read only data dir is fine
+	FILE * f = fopen(cache_file.c_str(), "wb");
+	if(f == nullptr) {
+		fprintf(verbose, "[OpenCL] Failed to write program cache %s: %s\n", cache_file.c_str(), strerror(errno));
+		return;
+	}
+
+	const cl_uint num_binaries = (cl_uint) data.size();
+	fwrite(cache_magic, sizeof(cache_magic), 1, f);
+	fwrite(&key, sizeof(key), 1, f);
+	fwrite(&num_binaries, sizeof(num_binaries), 1, f);
+	for(const std::vector<unsigned char> &binary : data) {
+		const cl_ulong size = binary.size();
+		fwrite(&size, sizeof(size), 1, f);
+		fwrite(&binary[0], size, 1, f);
+	}
+	fclose(f);
+
+	fprintf(verbose, "[OpenCL] Wrote program cache %s\n", cache_file.c_str());
+}
+
+cl::Program CL::create_program(const std::string &source_file, const std::string &options) const{
+	const std::string cache_key = source_file + " " + options;
+	auto it = cache.find(cache_key);
 	if(it != cache.end()) {
 		return it->second;
 	}
 
-	fprintf(verbose, "Building CL program %s\n", source_file.c_str());
-
+	//Preprocessing is cheap, the key must cover the included files too
 	std::string src = parse_file(PATH_BASE"/cl_programs/" + source_file, std::set<std::string>(), "");
 
+	const cl_ulong key = program_key(src, options);
+	//Each set of options is its own variant of the program, in its own file
+	std::string cache_file = PATH_BASE "/cl_programs/" + source_file;
+	if(!options.empty()) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%08x", (unsigned int) (program_key("", options) & 0xffffffffu));
+		cache_file += suffix;
+	}
+	cache_file += ".cache";
+
+	cl::Program program;
+	if(load_program_binaries(cache_file, key, options, program)) {
+		fprintf(verbose, "Loaded CL program %s from %s\n", source_file.c_str(), cache_file.c_str());
+		cache[cache_key] = program;
+		return program;
+	}
+
+	fprintf(verbose, "Building CL program %s\n", source_file.c_str());
+
 	cl_int err;
 	cl::Program::Sources source(1, std::make_pair(src.c_str(), src.size()));
 
-	cl::Program program = cl::Program(context_, source, &err);
+	program = cl::Program(context_, source, &err);
 
 	if(err != CL_SUCCESS) {
 		fprintf(stderr, "[OpenCL] Program creation error: %s\n", errorString(err));
 	}
 
-	err = program.build(devices_);
+	err = program.build(devices_, options.c_str());
 
 
 	std::string build_log;
@@ -277,7 +484,9 @@ cl::Program CL::create_program(const std::string &source_file) const{
 		util_abort();
 	}
 
-	cache[source_file] = program;
+	save_program_binaries(cache_file, key, program);
+
+	cache[cache_key] = program;
 
 	return program;
 }
@@ -326,6 +535,24 @@ cl::BufferGL CL::create_gl_buffer(cl_mem_flags flags, GLuint gl_buffer) const {
 	return buffer;
 }
 
+bool CL::gl_sharing() const {
+	return gl_sharing_;
+}
+
+bool CL::gl_event_support() const {
+	return gl_event_support_;
+}
+
+cl::Event CL::create_gl_sync_event(GLsync sync) const {
+	cl_int err;
+	cl_event event = clCreateEventFromGLsyncKHR(context_(), (cl_GLsync) sync, &err);
+	if(err != CL_SUCCESS) {
+		fprintf(stderr,"[OpenCL] Failed to create event from gl sync: %s\n", errorString(err));
+		util_abort();
+	}
+	return cl::Event(event);
+}
+
 /*
 cl::Image2DGL CL::create_from_gl_2d_image(cl_mem_flags flags, Texture2D * texture, GLenum texture_target, GLint miplevel) {
 	cl_int err;
@@ -13,16 +13,51 @@
 
 class CL {
 	public:
-		CL();
+		/*
+		 * platform: auto or part of the platform name.
+		 * device: auto, gpu, cpu, accelerator or part of the device name.
+		 * Among the matching devices the one sharing objects with the current gl context
+		 * is preferred, then gpus before cpus and last the fastest one.
+		 */
+		CL(const std::string &platform = "auto", const std::string &device = "auto");
 		~CL();
 
-		cl::Program create_program(const std::string &file_name) const;
+		/*
+		 * False if there is no platform or no device matching the settings.
+		 * Nothing else may be used then.
+		 */
+		bool available() const;
+
+		/*
+		 * Build the program in cl_programs/file_name with the given build options.
+		 * The binaries are cached in cl_programs/file_name.cache and reused while the source,
+		 * options, devices and drivers are the same.
+		 */
+		cl::Program create_program(const std::string &file_name, const std::string &options = "") const;
 
 		cl::Kernel load_kernel(const cl::Program &program, const char * kernel_name) const;
 
 		cl::Buffer create_buffer(cl_mem_flags flags, size_t size) const;
 		cl::BufferGL create_gl_buffer(cl_mem_flags flags, GLuint gl_buffer) const;
 
+		/*
+		 * True if the context shares objects with the current gl context,
+		 * otherwise create_gl_buffer may not be used and data must be copied
+		 */
+		bool gl_sharing() const;
+
+		/*
+		 * True if the context device supports cl_khr_gl_event, that is
+		 * if cl events can be created from gl sync objects
+		 */
+		bool gl_event_support() const;
+
+		/*
+		 * Create a cl event that is signaled when the gl fence sync is.
+		 * Requires gl_event_support()
+		 */
+		cl::Event create_gl_sync_event(GLsync sync) const;
+
 		/*cl::Image2DGL create_from_gl_2d_image(cl_mem_flags flags, Texture2D * texture, GLenum texture_target=GL_TEXTURE_2D, GLint miplevel = 0);
 		  cl::Image3DGL create_from_gl_3d_image(cl_mem_flags flags, Texture3D * texture, GLint miplevel = 0);*/
 
@@ -46,6 +81,19 @@ class CL {
 
 		static void load_file(const std::string &filename, std::stringstream &data, const std::string &included_from);
 
+		/*
+		 * Key for the binary cache, a hash of the preprocessed source, the build options
+		 * and the platform, devices and drivers the binaries are built for
+		 */
+		cl_ulong program_key(const std::string &source, const std::string &options) const;
+
+		/*
+		 * Create and build program from the binaries in cache_file, returns false if they are missing,
+		 * were built with another key or fail to build
+		 */
+		bool load_program_binaries(const std::string &cache_file, cl_ulong key, const std::string &options, cl::Program &program) const;
+		void save_program_binaries(const std::string &cache_file, cl_ulong key, const cl::Program &program) const;
+
 		static std::map<std::string, cl::Program> cache;
 
 		cl::Context context_;
@@ -57,6 +105,10 @@ class CL {
 		std::vector<cl::Device> devices_;
 		cl::Device context_device_;
 
+		bool gl_sharing_;
+		bool gl_event_support_;
+		bool available_;
+
 };
 
 #endif
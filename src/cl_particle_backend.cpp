@@ -0,0 +1,758 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cl_particle_backend.hpp"
+#include "globals.hpp"
+#include "utils.hpp"
+
+#include <GL/glew.h>
+#include <cstring>
+#include <algorithm>
+
+const CLParticleBackend::draw_args_t CLParticleBackend::draw_args_reset_ = { 0, 1, 0, 0 };
+
+//Hit enemies spawn_impacts spawns at in parallel, more than this are walked in turn
+static const int impact_lanes = 32;
+
+CLParticleBackend::CLParticleBackend(const std::vector<emitter_t> &emitters, const std::string &kernel, int max_num_enemies)
+	: ParticleBackend(emitters)
+	,	gl_sharing_(opencl->gl_sharing())
+	,	draw_indirect_(GLEW_ARB_draw_indirect && opencl->gl_sharing())
+	,	copy_pending_(false)
+	,	persistent_(false)
+	,	mapped_(nullptr)
+	,	draw_fence_(nullptr)
+	,	pool_initialized_(false)
+	,	kernel_file_(kernel)
+	,	program_features_(0)
+	,	needed_features_(0)
+	,	frame_(0)
+	,	gl_sync_(nullptr)
+	,	release_pending_(false)
+	,	max_num_enemies_(max_num_enemies)
+	,	num_hit_targets_(0)
+	,	hit_cell_size_(1.f)
+	,	impact_emitter_(0)
+	,	impact_count_(0)
+	,	impact_palette_index_(0)
+	,	hits_pending_(false) {
+
+	const int num_particles = num_particles_;
+	const cl_uint num_emitters = (cl_uint) emitters.size();
+
+	memset(&impact_config_host_, 0, sizeof(config_t));
+
+	heightfield_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(cl_float));
+	heightfield_size_.s[0] = heightfield_size_.s[1] = 0;
+	heightfield_scale_ = 1.f;
+
+	const std::vector<glm::vec4> &field = turbulence_field();
+	turbulence_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(cl_float4) * field.size());
+	cl_int field_err = opencl->queue().enqueueWriteBuffer(turbulence_, CL_TRUE, 0, sizeof(cl_float4) * field.size(), &field[0], NULL, NULL);
+	CL::check_error(field_err, "[ParticleSystem] Write turbulence field");
+
+	//Create VBO's, the vertex buffer is sized to the pool
+	create_draw_buffer();
+
+	glGenBuffers(1, &draw_args_buffer_);
+	glBindBuffer(GL_ARRAY_BUFFER, draw_args_buffer_);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(draw_args_t), &draw_args_reset_, GL_DYNAMIC_DRAW);
+
+	checkForGLErrors("[ParticleSystem] Buffer draw buffers");
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	draw_args_host_ = draw_args_reset_;
+	if(!draw_indirect_) {
+		fprintf(verbose, "[ParticleSystem] ARB_draw_indirect not supported, reading back the number of particles\n");
+	}
+
+	//Create cl buffers:
+	if(gl_sharing_) {
+		cl_gl_buffers_.push_back(opencl->create_gl_buffer(CL_MEM_READ_WRITE , draw_args_buffer_));
+		draw_args_ = cl_gl_buffers_[1];
+	} else {
+		fprintf(verbose, "[ParticleSystem] No cl-gl sharing, copying the vertices to gl (%s)\n", persistent_ ? "persistently mapped" : "mapped every frame");
+		draw_args_ = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(draw_args_t));
+	}
+
+	positions_ = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(cl_float4)*num_particles);
+	velocities_ = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(cl_float4)*num_particles);
+	particles_ = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(particle_t)*num_particles);
+	palette_buffer_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(palette_entry_t)*MAX_PALETTE_SIZE);
+	emitters_buffer_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(emitter_t)*num_emitters);
+	configs_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(config_t)*num_emitters);
+	free_list_ = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(cl_int)*num_particles);
+	free_counts_ = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(cl_int)*num_emitters);
+
+	//The particles and free lists are filled by free_range when the program is loaded.
+	//Until the first update is read back all particles are free
+	zeros_.resize(num_emitters, 0);
+	free_counts_host_.resize(num_emitters);
+	for(cl_uint e=0; e < num_emitters; ++e) {
+		free_counts_host_[e] = emitters[e].count;
+	}
+
+	cl_int err = opencl->queue().enqueueWriteBuffer(free_counts_, CL_FALSE, 0, sizeof(cl_int)*num_emitters, &zeros_[0], NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Write free count buffer");
+	err = opencl->queue().enqueueWriteBuffer(emitters_buffer_, CL_FALSE, 0, sizeof(emitter_t)*num_emitters, &emitters_[0], NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Write emitters buffer");
+
+	//Spawn buffers (arg 4 and 8) are created on demand
+	spawn_capacity_ = 0;
+
+	if(max_num_enemies > 0) {
+		enemies_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(enemy_data_t) * max_num_enemies);
+		grid_cells_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(cl_int) * 2 * grid_buckets(max_num_enemies));
+		grid_enemies_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(cl_int) * max_num_enemies);
+
+		hits_host_.resize(max_num_enemies);
+		hits_zero_.resize(max_num_enemies, enemy_hit_t());
+		hits_ = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(enemy_hit_t) * max_num_enemies);
+		hit_list_ = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(cl_int) * (1 + max_num_enemies));
+		impact_config_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(config_t));
+	}
+}
+
+CLParticleBackend::~CLParticleBackend() {
+	//Pending uploads may still read from our staging memory
+	opencl->queue().finish();
+	if(gl_sync_ != nullptr) glDeleteSync(gl_sync_);
+	delete_draw_buffer();
+	cl_gl_buffers_.clear();
+	draw_args_ = cl::Buffer();
+	glDeleteBuffers(1, &draw_args_buffer_);
+}
+
+void CLParticleBackend::create_draw_buffer() {
+	glGenBuffers(1, &draw_buffer_);
+	checkForGLErrors("[ParticleSystem] Generate GL buffer");
+	glBindBuffer(GL_ARRAY_BUFFER, draw_buffer_);
+#ifdef GL_ARB_buffer_storage
+	if(!gl_sharing_ && GLEW_ARB_buffer_storage) {
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, sizeof(vertex_t)*num_particles_, NULL, flags);
+		mapped_ = (vertex_t*) glMapBufferRange(GL_ARRAY_BUFFER, 0, sizeof(vertex_t)*num_particles_, flags);
+		persistent_ = (mapped_ != nullptr);
+	}
+#endif
+	if(!persistent_) {
+		glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_t)*num_particles_, NULL, gl_sharing_ ? GL_DYNAMIC_DRAW : GL_STREAM_DRAW);
+	}
+	checkForGLErrors("[ParticleSystem] Buffer vertices");
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//cl_gl_buffers_ holds the vertices first
+	if(gl_sharing_) {
+		const cl::BufferGL vertices = opencl->create_gl_buffer(CL_MEM_WRITE_ONLY, draw_buffer_);
+		if(cl_gl_buffers_.empty()) {
+			cl_gl_buffers_.push_back(vertices);
+		} else {
+			cl_gl_buffers_[0] = vertices;
+		}
+		draw_vertices_ = vertices;
+	} else {
+		draw_vertices_ = opencl->create_buffer(CL_MEM_WRITE_ONLY, sizeof(vertex_t)*num_particles_);
+	}
+}
+
+void CLParticleBackend::delete_draw_buffer() {
+	//The cl objects made from the gl buffer must be released before it is deleted
+	if(!cl_gl_buffers_.empty()) {
+		cl_gl_buffers_[0] = cl::BufferGL();
+	}
+	draw_vertices_ = cl::Buffer();
+
+	if(draw_fence_ != nullptr) {
+		glDeleteSync(draw_fence_);
+		draw_fence_ = nullptr;
+	}
+	if(persistent_) {
+		glBindBuffer(GL_ARRAY_BUFFER, draw_buffer_);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		persistent_ = false;
+		mapped_ = nullptr;
+	}
+	glDeleteBuffers(1, &draw_buffer_);
+}
+
+cl_uint CLParticleBackend::features(const config_t &config) {
+	cl_uint f = 0;
+	if(config.avg_gravity_influence != 0.f || config.gravity_influence_var != 0.f) f |= FEATURE_GRAVITY;
+	if(config.avg_wind_influence != 0.f || config.wind_influence_var != 0.f) f |= FEATURE_WIND;
+	if(config.motion_rand.x != 0.f || config.motion_rand.y != 0.f || config.motion_rand.z != 0.f) f |= FEATURE_MOTION_RAND;
+	if(config.avg_rotation_speed != 0.f || config.rotation_speed_var != 0.f) f |= FEATURE_ROTATION;
+	if(config.lod_distances != glm::vec4(0.f)) f |= FEATURE_LOD;
+	if((int) config.ground.x != ParticleSystem::GROUND_NONE) f |= FEATURE_GROUND;
+	if(config.turbulence.x != 0.f) f |= FEATURE_TURBULENCE;
+	return f;
+}
+
+void CLParticleBackend::load_program(cl_uint features) {
+	std::string options;
+	if(!(features & FEATURE_GRAVITY)) options += "-DNO_GRAVITY ";
+	if(!(features & FEATURE_WIND)) options += "-DNO_WIND ";
+	if(!(features & FEATURE_MOTION_RAND)) options += "-DNO_MOTION_RAND ";
+	if(!(features & FEATURE_ROTATION)) options += "-DNO_ROTATION ";
+	if(!(features & FEATURE_LOD)) options += "-DNO_LOD ";
+	if(!(features & FEATURE_GROUND)) options += "-DNO_GROUND ";
+	if(!(features & FEATURE_TURBULENCE)) options += "-DNO_TURBULENCE ";
+
+	fprintf(verbose, "[ParticleSystem] Loading %s with options \"%s\"\n", kernel_file_.c_str(), options.c_str());
+
+	program_ = opencl->create_program(kernel_file_, options);
+	run_kernel_  = opencl->load_kernel(program_, "run_particles");
+	spawn_kernel_  = opencl->load_kernel(program_, "spawn_particles");
+
+	free_range_kernel_ = opencl->load_kernel(program_, "free_range");
+	move_range_kernel_ = opencl->load_kernel(program_, "move_range");
+	program_features_ = features;
+
+	const cl_uint num_emitters = (cl_uint) emitters_.size();
+	cl_int err;
+
+	err = run_kernel_.setArg(3, palette_buffer_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 3");
+	err = run_kernel_.setArg(4, emitters_buffer_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 4");
+	err = run_kernel_.setArg(5, configs_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 5");
+	err = run_kernel_.setArg(6, num_emitters);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 6");
+	err = run_kernel_.setArg(7, seed_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 7");
+	err = run_kernel_.setArg(9, free_counts_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 9");
+	err = run_kernel_.setArg(11, draw_args_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 11");
+
+	set_heightfield_args();
+	err = run_kernel_.setArg(turbulence_arg(), turbulence_);
+	CL::check_error(err, "[ParticleSystem] run: Set turbulence field");
+
+	err = spawn_kernel_.setArg(3, emitters_buffer_);
+	CL::check_error(err, "[ParticleSystem] spawn: Set arg 3");
+	err = spawn_kernel_.setArg(5, seed_);
+	CL::check_error(err, "[ParticleSystem] spawn: Set arg 5");
+	err = spawn_kernel_.setArg(7, free_counts_);
+	CL::check_error(err, "[ParticleSystem] spawn: Set arg 7");
+
+	if(spawn_capacity_ > 0) {
+		err = spawn_kernel_.setArg(4, spawn_configs_buffer_);
+		CL::check_error(err, "[ParticleSystem] spawn: Set arg 4");
+		err = spawn_kernel_.setArg(8, spawn_requests_buffer_);
+		CL::check_error(err, "[ParticleSystem] spawn: Set arg 8");
+	}
+
+	if(max_num_enemies_ > 0) {
+		err = run_kernel_.setArg(14, enemies_);
+		CL::check_error(err, "[ParticleSystem] run: Set arg 14");
+		err = run_kernel_.setArg(15, num_hit_targets_);
+		CL::check_error(err, "[ParticleSystem] run: Set arg 15");
+		err = run_kernel_.setArg(16, grid_cells_);
+		CL::check_error(err, "[ParticleSystem] run: Set arg 16");
+		err = run_kernel_.setArg(17, grid_enemies_);
+		CL::check_error(err, "[ParticleSystem] run: Set arg 17");
+		err = run_kernel_.setArg(18, grid_buckets(max_num_enemies_));
+		CL::check_error(err, "[ParticleSystem] run: Set arg 18");
+		err = run_kernel_.setArg(19, hit_cell_size_);
+		CL::check_error(err, "[ParticleSystem] run: Set arg 19");
+		err = run_kernel_.setArg(20, hits_);
+		CL::check_error(err, "[ParticleSystem] run: Set arg 20");
+		err = run_kernel_.setArg(21, hit_list_);
+		CL::check_error(err, "[ParticleSystem] run: Set arg 21");
+
+		impact_kernel_ = opencl->load_kernel(program_, "spawn_impacts");
+		err = impact_kernel_.setArg(3, emitters_buffer_);
+		CL::check_error(err, "[ParticleSystem] impacts: Set arg 3");
+		err = impact_kernel_.setArg(4, impact_config_);
+		CL::check_error(err, "[ParticleSystem] impacts: Set arg 4");
+		err = impact_kernel_.setArg(5, seed_);
+		CL::check_error(err, "[ParticleSystem] impacts: Set arg 5");
+		err = impact_kernel_.setArg(7, free_counts_);
+		CL::check_error(err, "[ParticleSystem] impacts: Set arg 7");
+		err = impact_kernel_.setArg(8, enemies_);
+		CL::check_error(err, "[ParticleSystem] impacts: Set arg 8");
+		err = impact_kernel_.setArg(9, hit_list_);
+		CL::check_error(err, "[ParticleSystem] impacts: Set arg 9");
+	}
+
+	set_pool_args();
+}
+
+void CLParticleBackend::set_pool_args() {
+	cl_int err;
+
+	err = run_kernel_.setArg(0, positions_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 0");
+	err = run_kernel_.setArg(1, velocities_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 1");
+	err = run_kernel_.setArg(2, particles_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 2");
+	err = run_kernel_.setArg(8, free_list_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 8");
+	err = run_kernel_.setArg(10, draw_vertices_);
+	CL::check_error(err, "[ParticleSystem] run: Set arg 10");
+
+	err = spawn_kernel_.setArg(0, positions_);
+	CL::check_error(err, "[ParticleSystem] spawn: Set arg 0");
+	err = spawn_kernel_.setArg(1, velocities_);
+	CL::check_error(err, "[ParticleSystem] spawn: Set arg 1");
+	err = spawn_kernel_.setArg(2, particles_);
+	CL::check_error(err, "[ParticleSystem] spawn: Set arg 2");
+	err = spawn_kernel_.setArg(6, free_list_);
+	CL::check_error(err, "[ParticleSystem] spawn: Set arg 6");
+
+	if(max_num_enemies_ > 0) {
+		err = impact_kernel_.setArg(0, positions_);
+		CL::check_error(err, "[ParticleSystem] impacts: Set arg 0");
+		err = impact_kernel_.setArg(1, velocities_);
+		CL::check_error(err, "[ParticleSystem] impacts: Set arg 1");
+		err = impact_kernel_.setArg(2, particles_);
+		CL::check_error(err, "[ParticleSystem] impacts: Set arg 2");
+		err = impact_kernel_.setArg(6, free_list_);
+		CL::check_error(err, "[ParticleSystem] impacts: Set arg 6");
+	}
+}
+
+void CLParticleBackend::free_range(int emitter, int first, int begin, int end, bool clear) {
+	if(end <= begin) return;
+
+	cl_int err = free_range_kernel_.setArg(0, particles_);
+	CL::check_error(err, "[ParticleSystem] free range: Set arg 0");
+	err = free_range_kernel_.setArg(1, free_list_);
+	CL::check_error(err, "[ParticleSystem] free range: Set arg 1");
+	err = free_range_kernel_.setArg(2, free_counts_);
+	CL::check_error(err, "[ParticleSystem] free range: Set arg 2");
+	err = free_range_kernel_.setArg(3, (cl_int) emitter);
+	CL::check_error(err, "[ParticleSystem] free range: Set arg 3");
+	err = free_range_kernel_.setArg(4, (cl_int) first);
+	CL::check_error(err, "[ParticleSystem] free range: Set arg 4");
+	err = free_range_kernel_.setArg(5, (cl_int) begin);
+	CL::check_error(err, "[ParticleSystem] free range: Set arg 5");
+	err = free_range_kernel_.setArg(6, (cl_uint) clear);
+	CL::check_error(err, "[ParticleSystem] free range: Set arg 6");
+
+	err = opencl->queue().enqueueNDRangeKernel(free_range_kernel_, cl::NullRange, cl::NDRange(end - begin), cl::NullRange, NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Execute free_range");
+}
+
+void CLParticleBackend::move_range(int emitter, int first, int begin, int end) {
+	if(end <= begin) return;
+
+	cl_int err = move_range_kernel_.setArg(0, positions_);
+	CL::check_error(err, "[ParticleSystem] move range: Set arg 0");
+	err = move_range_kernel_.setArg(1, velocities_);
+	CL::check_error(err, "[ParticleSystem] move range: Set arg 1");
+	err = move_range_kernel_.setArg(2, particles_);
+	CL::check_error(err, "[ParticleSystem] move range: Set arg 2");
+	err = move_range_kernel_.setArg(3, free_list_);
+	CL::check_error(err, "[ParticleSystem] move range: Set arg 3");
+	err = move_range_kernel_.setArg(4, free_counts_);
+	CL::check_error(err, "[ParticleSystem] move range: Set arg 4");
+	err = move_range_kernel_.setArg(5, (cl_int) emitter);
+	CL::check_error(err, "[ParticleSystem] move range: Set arg 5");
+	err = move_range_kernel_.setArg(6, (cl_int) first);
+	CL::check_error(err, "[ParticleSystem] move range: Set arg 6");
+	err = move_range_kernel_.setArg(7, (cl_int) begin);
+	CL::check_error(err, "[ParticleSystem] move range: Set arg 7");
+
+	err = opencl->queue().enqueueNDRangeKernel(move_range_kernel_, cl::NullRange, cl::NDRange(end - begin), cl::NullRange, NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Execute move_range");
+}
+
+void CLParticleBackend::apply_layout(const std::vector<emitter_t> &old_layout) {
+	cl_int err;
+
+	//Shrinking ranges first: their free lists are rebuilt below the new end and the live particles past it moved down
+	for(size_t e=0; e < emitters_.size(); ++e) {
+		const emitter_t &from = old_layout[e];
+		const emitter_t &to = emitters_[e];
+		if(to.count >= from.count) continue;
+
+		err = opencl->queue().enqueueWriteBuffer(free_counts_, CL_FALSE, sizeof(cl_int) * e, sizeof(cl_int), &zeros_[e], NULL, NULL);
+		CL::check_error(err, "[ParticleSystem] Clear free count");
+		free_range((int) e, from.first, 0, to.count, false);
+		move_range((int) e, from.first, to.count, from.count);
+	}
+
+	//Copy the ranges to buffers of the new size, the free lists hold indices relative to the range so they are copied as they are
+	cl::Buffer positions = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(cl_float4)*num_particles_);
+	cl::Buffer velocities = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(cl_float4)*num_particles_);
+	cl::Buffer particles = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(particle_t)*num_particles_);
+	cl::Buffer free_list = opencl->create_buffer(CL_MEM_READ_WRITE, sizeof(cl_int)*num_particles_);
+
+	for(size_t e=0; e < emitters_.size(); ++e) {
+		const emitter_t &from = old_layout[e];
+		const emitter_t &to = emitters_[e];
+		const size_t count = std::min(from.count, to.count);
+
+		err = opencl->queue().enqueueCopyBuffer(positions_, positions, sizeof(cl_float4) * from.first, sizeof(cl_float4) * to.first, sizeof(cl_float4) * count, NULL, NULL);
+		CL::check_error(err, "[ParticleSystem] Copy positions");
+		err = opencl->queue().enqueueCopyBuffer(velocities_, velocities, sizeof(cl_float4) * from.first, sizeof(cl_float4) * to.first, sizeof(cl_float4) * count, NULL, NULL);
+		CL::check_error(err, "[ParticleSystem] Copy velocities");
+		err = opencl->queue().enqueueCopyBuffer(particles_, particles, sizeof(particle_t) * from.first, sizeof(particle_t) * to.first, sizeof(particle_t) * count, NULL, NULL);
+		CL::check_error(err, "[ParticleSystem] Copy particles");
+		err = opencl->queue().enqueueCopyBuffer(free_list_, free_list, sizeof(cl_int) * from.first, sizeof(cl_int) * to.first, sizeof(cl_int) * count, NULL, NULL);
+		CL::check_error(err, "[ParticleSystem] Copy free list");
+	}
+
+	positions_ = positions;
+	velocities_ = velocities;
+	particles_ = particles;
+	free_list_ = free_list;
+
+	//The grown part of a range is all dead
+	for(size_t e=0; e < emitters_.size(); ++e) {
+		free_range((int) e, emitters_[e].first, old_layout[e].count, emitters_[e].count, true);
+	}
+
+	//Left untouched until the next resize, which waits for the update
+	err = opencl->queue().enqueueWriteBuffer(emitters_buffer_, CL_FALSE, 0, sizeof(emitter_t) * emitters_.size(), &emitters_[0], NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Write emitters buffer");
+
+	//Not in use by cl, update() resizes before acquiring the gl buffers
+	delete_draw_buffer();
+	create_draw_buffer();
+
+	set_pool_args();
+}
+
+void CLParticleBackend::update_config(int emitter, const config_t &config) {
+	needed_features_ |= features(config);
+	write_config(configs_, emitter, config);
+}
+
+void CLParticleBackend::write_config(cl::Buffer &buffer, int index, const config_t &c) {
+	//The write is non-blocking, so the data must live until the queue is past it
+	staged_configs_.push_back(c);
+	cl_int err = opencl->queue().enqueueWriteBuffer(buffer, CL_FALSE, sizeof(config_t) * index, sizeof(config_t), &staged_configs_.back(), NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Write config");
+}
+
+void CLParticleBackend::wait() {
+	if(release_pending_) {
+		release_event_.wait();
+		release_pending_ = false;
+		//Everything enqueued before the release is done, staging memory can be reused
+		in_flight_configs_.clear();
+	}
+	if(copy_pending_) {
+		copy_vertices();
+		copy_pending_ = false;
+	}
+}
+
+void CLParticleBackend::copy_vertices() {
+	const size_t size = sizeof(vertex_t) * draw_args_host_.count;
+	if(size == 0) return;
+
+	vertex_t * dst = mapped_;
+	if(persistent_) {
+		//Wait for gl to be done drawing the last copy
+		if(draw_fence_ != nullptr) {
+			while(glClientWaitSync(draw_fence_, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) { }
+			glDeleteSync(draw_fence_);
+			draw_fence_ = nullptr;
+		}
+	} else {
+		glBindBuffer(GL_ARRAY_BUFFER, draw_buffer_);
+		dst = (vertex_t*) glMapBufferRange(GL_ARRAY_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if(dst == nullptr) {
+			fprintf(stderr, "[ParticleSystem] Failed to map vertex buffer\n");
+			util_abort();
+		}
+	}
+
+	//Only the live vertices, run_particles compacts them to the start
+	cl_int err = opencl->queue().enqueueReadBuffer(draw_vertices_, CL_TRUE, 0, size, dst, NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Read vertices");
+
+	if(!persistent_) {
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+}
+
+void CLParticleBackend::set_hit_targets(const hit_targets_t &targets) {
+	cl_int err;
+
+	num_hit_targets_ = std::min(targets.num_enemies, (cl_uint) max_num_enemies_);
+
+	//The host data is left untouched until the release event, so the writes can be non-blocking
+	if(num_hit_targets_ > 0) {
+		err = opencl->queue().enqueueWriteBuffer(enemies_, CL_FALSE, 0, sizeof(enemy_data_t) * num_hit_targets_, targets.enemies, NULL,NULL);
+		CL::check_error(err, "[ParticleSystem] write enemies");
+		err = opencl->queue().enqueueWriteBuffer(grid_cells_, CL_FALSE, 0, sizeof(cl_int) * 2 * grid_buckets(max_num_enemies_), targets.cells, NULL,NULL);
+		CL::check_error(err, "[ParticleSystem] write enemy grid");
+		err = opencl->queue().enqueueWriteBuffer(grid_enemies_, CL_FALSE, 0, sizeof(cl_int) * num_hit_targets_, targets.grid_enemies, NULL,NULL);
+		CL::check_error(err, "[ParticleSystem] write enemy grid entries");
+		err = opencl->queue().enqueueWriteBuffer(hits_, CL_FALSE, 0, sizeof(enemy_hit_t) * num_hit_targets_, &(hits_zero_[0]), NULL,NULL);
+		CL::check_error(err, "[ParticleSystem] clear enemy hits");
+		err = opencl->queue().enqueueWriteBuffer(hit_list_, CL_FALSE, 0, sizeof(cl_int), &zeros_[0], NULL,NULL);
+		CL::check_error(err, "[ParticleSystem] clear enemy hit list");
+	}
+	hit_cell_size_ = targets.cell_size;
+
+	impact_count_ = targets.impact_config != nullptr ? targets.impact_count : 0;
+	if(impact_count_ > 0) {
+		impact_emitter_ = targets.impact_emitter;
+		//Looked up every time, the entry may have been replaced
+		impact_palette_index_ = palette_index(*targets.impact_config);
+		needed_features_ |= features(*targets.impact_config);
+		if(memcmp(&impact_config_host_, targets.impact_config, sizeof(config_t)) != 0) {
+			impact_config_host_ = *targets.impact_config;
+			write_config(impact_config_, 0, impact_config_host_);
+		}
+	}
+
+	//Otherwise set when the program is loaded
+	if(program_() != NULL) {
+		err = run_kernel_.setArg(15, num_hit_targets_);
+		CL::check_error(err, "[ParticleSystem] update hitting: set arg 15");
+		err = run_kernel_.setArg(19, hit_cell_size_);
+		CL::check_error(err, "[ParticleSystem] update hitting: set arg 19");
+	}
+}
+
+void CLParticleBackend::set_heightfield(const heightfield_t &heightfield) {
+	const size_t size = sizeof(cl_float) * heightfield.size.x * heightfield.size.y;
+	if(size == 0) return;
+
+	//Set once per level, so a blocking upload is fine
+	wait();
+	heightfield_ = opencl->create_buffer(CL_MEM_READ_ONLY, size);
+	cl_int err = opencl->queue().enqueueWriteBuffer(heightfield_, CL_TRUE, 0, size, heightfield.heights, NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Write heightfield");
+
+	heightfield_size_.s[0] = heightfield.size.x;
+	heightfield_size_.s[1] = heightfield.size.y;
+	heightfield_scale_ = heightfield.horizontal_scale;
+
+	//Otherwise set when the program is loaded
+	if(program_() != NULL) set_heightfield_args();
+}
+
+void CLParticleBackend::set_heightfield_args() {
+	//The heightfield comes after the hit test arguments in hitting_particles.cl
+	const cl_uint arg = max_num_enemies_ > 0 ? 22 : 14;
+	cl_int err = run_kernel_.setArg(arg, heightfield_);
+	CL::check_error(err, "[ParticleSystem] run: Set heightfield");
+	err = run_kernel_.setArg(arg + 1, heightfield_size_);
+	CL::check_error(err, "[ParticleSystem] run: Set heightfield size");
+	err = run_kernel_.setArg(arg + 2, heightfield_scale_);
+	CL::check_error(err, "[ParticleSystem] run: Set heightfield scale");
+}
+
+cl_uint CLParticleBackend::turbulence_arg() const {
+	return max_num_enemies_ > 0 ? 25 : 17;
+}
+
+const ParticleBackend::enemy_hit_t * CLParticleBackend::read_hits() {
+	if(!hits_pending_) return nullptr;
+
+	//The hits are read back before the gl buffers are released
+	wait();
+	hits_pending_ = false;
+	return &hits_host_[0];
+}
+
+void CLParticleBackend::spawn_particles() {
+	if(spawn_requests_.empty()) return;
+
+	cl_int err;
+	const size_t num_requests = spawn_requests_.size();
+
+	if(num_requests > spawn_capacity_) {
+		//Grow spawn buffers
+		spawn_capacity_ = std::max(num_requests, 2 * spawn_capacity_);
+		spawn_configs_buffer_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(config_t) * spawn_capacity_);
+		spawn_requests_buffer_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(spawn_request_t) * spawn_capacity_);
+
+		err = spawn_kernel_.setArg(4, spawn_configs_buffer_);
+		CL::check_error(err, "[ParticleSystem] spawn: Set arg 4");
+		err = spawn_kernel_.setArg(8, spawn_requests_buffer_);
+		CL::check_error(err, "[ParticleSystem] spawn: Set arg 8");
+	}
+
+	//Host vectors are left untouched until the release event, so the writes can be non-blocking
+	err = opencl->queue().enqueueWriteBuffer(spawn_configs_buffer_, CL_FALSE, 0, sizeof(config_t) * num_requests, &spawn_configs_[0], NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] spawn: Write configs");
+	err = opencl->queue().enqueueWriteBuffer(spawn_requests_buffer_, CL_FALSE, 0, sizeof(spawn_request_t) * num_requests, &spawn_requests_[0], NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] spawn: Write requests");
+
+	err = spawn_kernel_.setArg(9, (cl_uint) num_requests);
+	CL::check_error(err, "[ParticleSystem] spawn: set number of requests");
+	err = spawn_kernel_.setArg(10, frame_);
+	CL::check_error(err, "[ParticleSystem] spawn: set frame");
+
+	const spawn_request_t &last = spawn_requests_.back();
+
+	//One work-item per particle, each finds its request and pops a slot from the free list
+	err = opencl->queue().enqueueNDRangeKernel(spawn_kernel_, cl::NullRange, cl::NDRange(last.offset + last.count), cl::NullRange, NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Execute spawn_kernel");
+}
+
+void CLParticleBackend::update(float dt) {
+	cl_int err;
+
+	//Normally already done, draw() waits for it
+	wait();
+
+	//Spawned particles carry their own gravity, wind and rotation
+	for(const config_t &c : spawn_configs_) {
+		needed_features_ |= features(c);
+	}
+	if(program_() == NULL) {
+		load_program(needed_features_);
+	} else if((needed_features_ & ~program_features_) != 0) {
+		fprintf(verbose, "[ParticleSystem] A config needs terms compiled out of %s, using the generic kernels\n", kernel_file_.c_str());
+		load_program(ALL_FEATURES);
+	}
+
+	if(!pool_initialized_) {
+		//All particles start out dead, so every slot is free
+		for(size_t e=0; e < emitters_.size(); ++e) {
+			free_range((int) e, emitters_[e].first, 0, emitters_[e].count, true);
+		}
+		pool_initialized_ = true;
+	}
+
+	//Without live or new particles that are hit tested no enemy can be hit, and spawn_impacts is skipped.
+	//Counted before the resize, the free counts are from the old layout
+	bool may_hit = false;
+	for(size_t e=0; e < emitters_.size(); ++e) {
+		if(emitters_[e].hit_test && free_counts_host_[e] < emitters_[e].count) may_hit = true;
+	}
+	for(const spawn_request_t &request : spawn_requests_) {
+		if(emitters_[request.emitter].hit_test) may_hit = true;
+	}
+
+	//May replace the vertex buffer, so before it is acquired
+	resize_pool(free_counts_host_);
+
+	/*
+	 * Make sure opengl is done with our vbos (only shared with gl sharing).
+	 * If the device supports cl_khr_gl_event the acquire waits for a gl fence
+	 * on the device, otherwise we have to stall until gl is done.
+	 */
+	if(gl_sharing_) {
+		std::vector<cl::Event> gl_done;
+		if(opencl->gl_event_support()) {
+			if(gl_sync_ != nullptr) glDeleteSync(gl_sync_);
+			gl_sync_ = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			gl_done.push_back(opencl->create_gl_sync_event(gl_sync_));
+		} else {
+			glFinish();
+		}
+
+		err = opencl->queue().enqueueAcquireGLObjects((std::vector<cl::Memory>*) &cl_gl_buffers_, gl_done.empty() ? NULL : &gl_done, NULL);
+		CL::check_error(err, "[ParticleSystem] acquire gl objects");
+	}
+
+	if(palette_dirty_) {
+		//Only changed by add_spawn_request, after wait()
+		err = opencl->queue().enqueueWriteBuffer(palette_buffer_, CL_FALSE, 0, sizeof(palette_entry_t) * palette_.size(), &palette_[0], NULL, NULL);
+		CL::check_error(err, "[ParticleSystem] Write palette");
+		palette_dirty_ = false;
+	}
+
+	//All requests of this frame are uploaded together and spawned in a single launch.
+	spawn_particles();
+
+	//run_particles appends the live particles to the draw buffer
+	err = opencl->queue().enqueueWriteBuffer(draw_args_, CL_FALSE, 0, sizeof(draw_args_t), &draw_args_reset_, NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Reset draw args");
+
+	err = run_kernel_.setArg(12, dt);
+	CL::check_error(err, "[ParticleSystem] run: set dt");
+	err = run_kernel_.setArg(13, frame_);
+	CL::check_error(err, "[ParticleSystem] run: set frame");
+	err = run_kernel_.setArg(turbulence_arg() + 1, sizeof(cl_float4), &turbulence_offset_);
+	CL::check_error(err, "[ParticleSystem] run: set turbulence offset");
+
+	//Sized to the ranges in use, not to what the emitters reserve
+	err = opencl->queue().enqueueNDRangeKernel(run_kernel_, cl::NullRange, cl::NDRange(num_particles_), cl::NullRange, NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Execute run_kernel");
+
+	if(may_hit && num_hit_targets_ > 0 && impact_count_ > 0) {
+		//The hits never leave the device, count work-items for each of a few lanes that walk the hit list
+		const cl_uint lanes = std::min(num_hit_targets_, (cl_uint) impact_lanes);
+		err = impact_kernel_.setArg(10, impact_emitter_);
+		CL::check_error(err, "[ParticleSystem] impacts: set emitter");
+		err = impact_kernel_.setArg(11, (cl_uint) impact_palette_index_);
+		CL::check_error(err, "[ParticleSystem] impacts: set palette index");
+		err = impact_kernel_.setArg(12, impact_count_);
+		CL::check_error(err, "[ParticleSystem] impacts: set count");
+		err = impact_kernel_.setArg(13, lanes);
+		CL::check_error(err, "[ParticleSystem] impacts: set lanes");
+		err = impact_kernel_.setArg(14, frame_);
+		CL::check_error(err, "[ParticleSystem] impacts: set frame");
+
+		err = opencl->queue().enqueueNDRangeKernel(impact_kernel_, cl::NullRange, cl::NDRange(lanes * impact_count_), cl::NullRange, NULL, NULL);
+		CL::check_error(err, "[ParticleSystem] Execute impact_kernel");
+	}
+
+	if(!draw_indirect_) {
+		//Used by draw(), which waits for the release
+		err = opencl->queue().enqueueReadBuffer(draw_args_, CL_FALSE, 0, sizeof(draw_args_t), &draw_args_host_, NULL, NULL);
+		CL::check_error(err, "[ParticleSystem] Read draw args");
+	}
+
+	//For resizing the pool in the next update
+	err = opencl->queue().enqueueReadBuffer(free_counts_, CL_FALSE, 0, sizeof(cl_int) * free_counts_host_.size(), &free_counts_host_[0], NULL, NULL);
+	CL::check_error(err, "[ParticleSystem] Read free counts");
+
+	if(num_hit_targets_ > 0) {
+		//Picked up by read_hits, done when the release is
+		err = opencl->queue().enqueueReadBuffer(hits_, CL_FALSE, 0, sizeof(enemy_hit_t) * num_hit_targets_, &(hits_host_[0]), NULL, NULL);
+		CL::check_error(err, "[ParticleSystem] read enemy hits");
+		hits_pending_ = true;
+	}
+
+	if(gl_sharing_) {
+		err = opencl->queue().enqueueReleaseGLObjects((std::vector<cl::Memory>*)&cl_gl_buffers_, NULL, &release_event_);
+		CL::check_error(err, "[ParticleSystem] Release GL objects");
+	} else {
+		//The queue is in order, so the marker is done when everything above is
+		err = opencl->queue().enqueueMarker(&release_event_);
+		CL::check_error(err, "[ParticleSystem] Enqueue marker");
+		copy_pending_ = true;
+	}
+	release_pending_ = true;
+
+	//All uploads staged so far complete before the release event
+	in_flight_configs_.splice(in_flight_configs_.end(), staged_configs_);
+
+	++frame_;
+
+	opencl->queue().flush();
+}
+
+void CLParticleBackend::draw() {
+	//Don't draw until the kernels are done with the vbo
+	wait();
+
+	glBindBuffer(GL_ARRAY_BUFFER, draw_buffer_);
+
+	vertex_attrib_pointers();
+
+	if(draw_indirect_) {
+		//The number of live particles never leaves the gpu
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draw_args_buffer_);
+		glDrawArraysIndirect(GL_POINTS, (GLvoid*) 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	} else {
+		glDrawArrays(GL_POINTS, 0, draw_args_host_.count);
+	}
+
+	if(persistent_) {
+		//The next copy_vertices must not overwrite what is being drawn
+		if(draw_fence_ != nullptr) glDeleteSync(draw_fence_);
+		draw_fence_ = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
@@ -0,0 +1,207 @@
+#ifndef CL_PARTICLE_BACKEND_HPP
+#define CL_PARTICLE_BACKEND_HPP
+
+#include "particle_backend.hpp"
+#include "cl.hpp"
+
+#include <list>
+#include <string>
+#include <vector>
+
+/*
+ * Runs the particles in OpenCL kernels, directly on the gl vertex buffers.
+ * Without cl-gl sharing the kernels write plain cl buffers and the live vertices are
+ * copied into the (persistently if possible) mapped gl vertex buffer.
+ */
+class CLParticleBackend : public ParticleBackend {
+	public:
+		CLParticleBackend(const std::vector<emitter_t> &emitters, const std::string &kernel, int max_num_enemies);
+		virtual ~CLParticleBackend();
+
+		virtual void wait();
+		virtual void update(float dt);
+		virtual void update_config(int emitter, const config_t &config);
+		virtual void set_hit_targets(const hit_targets_t &targets);
+		virtual void set_heightfield(const heightfield_t &heightfield);
+		virtual const enemy_hit_t * read_hits();
+		virtual void draw();
+
+	protected:
+		virtual void apply_layout(const std::vector<emitter_t> &old_layout);
+
+	private:
+
+		/**
+		 * Internal function for enqueueing spawning of all requests in the batch
+		 */
+		void spawn_particles();
+
+		/*
+		 * Terms of the run kernel a config needs, see particles_spawn.cl
+		 */
+		enum feature_t {
+			FEATURE_GRAVITY = 1,
+			FEATURE_WIND = 2,
+			FEATURE_MOTION_RAND = 4,
+			FEATURE_ROTATION = 8,
+			FEATURE_LOD = 16,
+			FEATURE_GROUND = 32,
+			FEATURE_TURBULENCE = 64,
+			ALL_FEATURES = 127
+		};
+
+		static cl_uint features(const config_t &config);
+
+		/*
+		 * Build (or take from the cache) the program with only the given features compiled in,
+		 * and set the kernel arguments that don't change every frame
+		 */
+		void load_program(cl_uint features);
+
+		//Kernel arguments that change when the pool is resized
+		void set_pool_args();
+
+		/*
+		 * Enqueue free_range or move_range (see particles_spawn.cl) on [begin, end) of the range of emitter
+		 * that starts at first in the current buffers
+		 */
+		void free_range(int emitter, int first, int begin, int end, bool clear);
+		void move_range(int emitter, int first, int begin, int end);
+
+		/*
+		 * The vertex buffer holds a vertex per particle of the pool, it is replaced when the pool is resized
+		 */
+		void create_draw_buffer();
+		void delete_draw_buffer();
+
+		void set_heightfield_args();
+
+		//Arguments of run_kernel_ after the heightfield
+		cl_uint turbulence_arg() const;
+
+		/*
+		 * Enqueue a non-blocking write of c to element index of buffer.
+		 * c is copied to staging memory that is kept until the write is done
+		 */
+		void write_config(cl::Buffer &buffer, int index, const config_t &c);
+
+		/*
+		 * Without gl sharing: copy the live vertices of the finished update to draw_buffer_
+		 */
+		void copy_vertices();
+
+		// Live vertices compacted by run_particles and the glDrawArraysIndirect arguments for them.
+		// cl_gl_buffers_ holds draw_buffer_ and draw_args_buffer_ in that order
+		GLuint draw_buffer_, draw_args_buffer_;
+		bool gl_sharing_; //Otherwise the kernels write draw_vertices_ and draw_args_ which are copied to gl
+		bool draw_indirect_; //ARB_draw_indirect and gl sharing are supported, otherwise the count is read back
+
+		std::vector<cl::BufferGL> cl_gl_buffers_;
+
+		// Written by run_particles, the gl buffers above when sharing
+		cl::Buffer draw_vertices_, draw_args_;
+
+		// Without gl sharing: the copy of the vertices is done in wait()
+		bool copy_pending_;
+		bool persistent_; //ARB_buffer_storage, draw_buffer_ is mapped once
+		vertex_t * mapped_;
+		GLsync draw_fence_; //gl is done drawing from the persistently mapped buffer
+
+		// Particle state, see particles_structs.cl.
+		// positions_: xyz and rotation, velocities_: xyz and rotation speed
+		cl::Buffer positions_, velocities_, particles_, palette_buffer_;
+
+		// The emitter table and a config per emitter
+		cl::Buffer emitters_buffer_, configs_;
+
+		// Stacks of indices of dead particles, one in the range of each emitter, and their sizes.
+		// Pushed to by run_particles, popped by spawn_particles
+		cl::Buffer free_list_, free_counts_;
+
+		// Free counts of the last update, read back for resize_pool
+		std::vector<cl_int> free_counts_host_, zeros_;
+		bool pool_initialized_; //The ranges are filled by free_range when the program is loaded
+
+		//Must be same as in particles_structs.cl
+		struct draw_args_t {
+			cl_uint count;
+			cl_uint instance_count;
+			cl_uint first;
+			cl_uint base_instance;
+		};
+
+		//Written to the draw args before each run
+		static const draw_args_t draw_args_reset_;
+
+		// Spawn batch for the current frame, the gpu buffers grow as needed
+		cl::Buffer spawn_configs_buffer_, spawn_requests_buffer_;
+		size_t spawn_capacity_;
+
+		// Specialised on the features needed by the configs when first updated.
+		// A later config needing more falls back to the generic program (all features)
+		const std::string kernel_file_;
+		cl::Program program_;
+		cl::Kernel run_kernel_, spawn_kernel_, free_range_kernel_, move_range_kernel_;
+		cl_uint program_features_, needed_features_;
+
+		//Must be same as in particles_structs.cl
+		struct particle_t {
+			cl_float ttl; //Alive while > 0
+			cl_half org_ttl;
+			cl_half initial_scale;
+			cl_half final_scale;
+			cl_half wind_influence;
+			cl_half gravity_influence;
+			cl_uchar texture_index;
+			cl_uchar palette_index;
+		};
+
+		static_assert(sizeof(particle_t) == 16, "particle_t must match particles_structs.cl");
+
+		//Counter for the random streams, increased every update
+		cl_uint frame_;
+
+		//Number of live particles when drawing without ARB_draw_indirect
+		draw_args_t draw_args_host_;
+
+		//Fence for gl being done with our buffers (only with cl_khr_gl_event)
+		GLsync gl_sync_;
+
+		//Signaled when the last update has released the gl buffers (or is done, without sharing)
+		cl::Event release_event_;
+		bool release_pending_;
+
+		//Host copies of configs with pending non-blocking writes.
+		//staged: not yet covered by a release event, in flight: done when release_event_ is
+		std::list<config_t> staged_configs_, in_flight_configs_;
+
+		//Terrain heights for the ground collision, a single dummy height until set
+		cl::Buffer heightfield_;
+		cl_int2 heightfield_size_;
+		cl_float heightfield_scale_;
+
+		//ParticleBackend::turbulence_field(), uploaded once
+		cl::Buffer turbulence_;
+
+		//Hit test, only with max_num_enemies > 0
+		const int max_num_enemies_;
+		cl::Buffer enemies_, grid_cells_, grid_enemies_;
+		cl_uint num_hit_targets_;
+		cl_float hit_cell_size_;
+
+		//Spawned at the hit enemies by spawn_impacts, see hit_targets_t
+		cl::Kernel impact_kernel_;
+		cl::Buffer impact_config_;
+		config_t impact_config_host_;
+		cl_int impact_emitter_;
+		cl_uint impact_count_;
+		cl_uchar impact_palette_index_;
+
+		//Damage accumulated on the gpu for each enemy, read back before the release.
+		//hit_list_ holds the number of enemies hit and their indices, for spawn_impacts
+		cl::Buffer hits_, hit_list_;
+		std::vector<enemy_hit_t> hits_host_, hits_zero_;
+		bool hits_pending_;
+};
+
+#endif
@@ -0,0 +1,768 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cpu_particle_backend.hpp"
+#include "globals.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+unsigned int CPUParticleBackend::num_threads = 0;
+
+//Don't split the pool in smaller parts than this
+static const int min_task_size = 4096;
+
+/*
+ * Threads shared by all cpu particle systems.
+ * run() hands out tasks to the workers and the calling thread and returns when all are done.
+ * A worker still leaving work() of the last run would take indices from the reset counter,
+ * so run() waits for all workers to go idle before it resets.
+ */
+class ParticleWorkers {
+	public:
+		ParticleWorkers(unsigned int num_workers) : task_(nullptr), num_tasks_(0), next_(0), done_(0), generation_(0), active_(0), stop_(false) {
+			for(unsigned int i=0; i < num_workers; ++i) {
+				threads_.push_back(std::thread(&ParticleWorkers::loop, this));
+			}
+		}
+
+		~ParticleWorkers() {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stop_ = true;
+			}
+			wake_.notify_all();
+			for(std::thread &t : threads_) t.join();
+		}
+
+		void run(int num_tasks, const std::function<void(int)> &task) {
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				done_cond_.wait(lock, [&]{ return active_ == 0; });
+				task_ = &task;
+				done_ = 0;
+				next_ = 0;
+				num_tasks_ = num_tasks;
+				++generation_;
+			}
+			wake_.notify_all();
+
+			work();
+
+			std::unique_lock<std::mutex> lock(mutex_);
+			done_cond_.wait(lock, [&]{ return done_ == num_tasks; });
+		}
+
+	private:
+		void work() {
+			for(;;) {
+				const int t = next_++;
+				if(t >= num_tasks_) return;
+				(*task_)(t);
+				if(++done_ == num_tasks_) {
+					std::lock_guard<std::mutex> lock(mutex_);
+					done_cond_.notify_all();
+				}
+			}
+		}
+
+		void loop() {
+			unsigned int seen = 0;
+			for(;;) {
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					wake_.wait(lock, [&]{ return stop_ || generation_ != seen; });
+					if(stop_) return;
+					seen = generation_;
+					++active_;
+				}
+				work();
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					if(--active_ == 0) done_cond_.notify_all();
+				}
+			}
+		}
+
+		std::vector<std::thread> threads_;
+		std::mutex mutex_;
+		std::condition_variable wake_, done_cond_;
+		std::atomic<const std::function<void(int)>*> task_;
+		std::atomic<int> num_tasks_, next_, done_;
+		unsigned int generation_;
+		int active_; //Workers inside work()
+		bool stop_;
+};
+
+static ParticleWorkers * workers = nullptr;
+static int num_backends = 0;
+
+static unsigned int total_threads() {
+	if(CPUParticleBackend::num_threads > 0) return CPUParticleBackend::num_threads;
+	return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+CPUParticleBackend::CPUParticleBackend(const std::vector<emitter_t> &emitters, int max_num_enemies)
+	: ParticleBackend(emitters)
+	,	frame_(0)
+	,	spawn_rng_(seed_ | 1u)
+	,	persistent_(false)
+	,	mapped_(nullptr)
+	,	region_(NUM_REGIONS - 1)
+	,	region_stride_(0)
+	,	max_num_enemies_(max_num_enemies)
+	,	num_buckets_(grid_buckets(max_num_enemies))
+	,	hits_pending_(false) {
+
+	if(num_backends++ == 0) {
+		workers = new ParticleWorkers(total_threads() - 1);
+	}
+
+	//Pad to a multiple of four so the sse loop never has to stop early, the padding is always dead
+	const int padded_size = (num_particles_ + 3) & ~3;
+
+	for(std::vector<float> * v : { &position_x_, &position_y_, &position_z_, &position_w_, &velocity_x_, &velocity_y_, &velocity_z_,
+			&ttl_, &org_ttl_, &rotation_speed_, &initial_scale_, &final_scale_, &wind_influence_, &gravity_influence_ }) {
+		v->resize(padded_size, 0.f);
+	}
+	std::fill(org_ttl_.begin(), org_ttl_.end(), 1.f);
+	texture_index_.resize(padded_size, 0);
+	palette_index_.resize(padded_size, 0);
+	dead_.resize(padded_size, 1);
+
+	//All particles start out dead, pop the low indices first
+	free_lists_.resize(emitters.size());
+	configs_.resize(emitters.size());
+	for(size_t e=0; e < emitters.size(); ++e) {
+		free_lists_[e].reserve(emitters[e].count);
+		for(int i=emitters[e].first + emitters[e].count - 1; i >= emitters[e].first; --i) {
+			free_lists_[e].push_back(i);
+		}
+	}
+
+	split_tasks();
+
+	targets_.num_enemies = 0;
+	targets_.impact_config = nullptr;
+	targets_.impact_count = 0;
+	heightfield_.heights = nullptr;
+	hits_.resize(std::max(max_num_enemies, 1));
+
+	for(GLsync &fence : region_fence_) fence = nullptr;
+
+	create_vertex_buffer();
+	if(!persistent_) {
+		fprintf(verbose, "[ParticleSystem] ARB_buffer_storage not supported, mapping the vertex buffer every frame\n");
+	}
+
+	fprintf(verbose, "[ParticleSystem] Running %d particles on the cpu in %d parts\n", num_particles_, num_tasks_);
+}
+
+CPUParticleBackend::~CPUParticleBackend() {
+	delete_vertex_buffer();
+
+	if(--num_backends == 0) {
+		delete workers;
+		workers = nullptr;
+	}
+}
+
+void CPUParticleBackend::split_tasks() {
+	//Parts of a multiple of four particles
+	const int padded_size = (int) dead_.size();
+	num_tasks_ = std::max(1, std::min((int) total_threads(), num_particles_ / min_task_size));
+	task_size_ = (((padded_size + num_tasks_ - 1) / num_tasks_) + 3) & ~3;
+	draw_first_.assign(num_tasks_, 0);
+	draw_count_.assign(num_tasks_, 0);
+	task_freed_.resize(num_tasks_);
+	task_hits_.resize(num_tasks_);
+}
+
+void CPUParticleBackend::create_vertex_buffer() {
+	glGenBuffers(1, &gl_buffer_);
+	checkForGLErrors("[ParticleSystem] Generate GL buffer");
+	glBindBuffer(GL_ARRAY_BUFFER, gl_buffer_);
+
+	const GLsizeiptr size = sizeof(vertex_t) * num_particles_ * NUM_REGIONS;
+#ifdef GL_ARB_buffer_storage
+	if(GLEW_ARB_buffer_storage) {
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+		mapped_ = (vertex_t*) glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+		persistent_ = (mapped_ != nullptr);
+	}
+#endif
+	if(!persistent_) {
+		glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+	}
+	checkForGLErrors("[ParticleSystem] Buffer vertices");
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	region_stride_ = num_particles_;
+}
+
+void CPUParticleBackend::delete_vertex_buffer() {
+	for(GLsync &fence : region_fence_) {
+		if(fence != nullptr) glDeleteSync(fence);
+		fence = nullptr;
+	}
+	if(persistent_) {
+		glBindBuffer(GL_ARRAY_BUFFER, gl_buffer_);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		persistent_ = false;
+		mapped_ = nullptr;
+	}
+	glDeleteBuffers(1, &gl_buffer_);
+}
+
+//Copy the particles of the old pool to the slots in src that are not -1, the others get fill
+template <typename T>
+static void move_particles(std::vector<T> &v, const std::vector<int> &src, T fill) {
+	std::vector<T> moved(src.size(), fill);
+	for(size_t i=0; i < src.size(); ++i) {
+		if(src[i] >= 0) moved[i] = v[src[i]];
+	}
+	v.swap(moved);
+}
+
+void CPUParticleBackend::apply_layout(const std::vector<emitter_t> &old_layout) {
+	//Where each particle of the new pool comes from in the old one, -1 for dead ones
+	const int padded_size = (num_particles_ + 3) & ~3;
+	std::vector<int> src(padded_size, -1);
+
+	for(size_t e=0; e < emitters_.size(); ++e) {
+		const emitter_t &from = old_layout[e];
+		const emitter_t &to = emitters_[e];
+
+		//Live particles keep their place, those past the end of a shrunk range take a dead slot below it
+		int slot = 0;
+		for(int i=0; i < from.count; ++i) {
+			if(dead_[from.first + i] != 0) continue;
+			if(i < to.count) {
+				src[to.first + i] = from.first + i;
+				continue;
+			}
+			//resize_pool leaves enough room, but never write past the range
+			while(slot < to.count && (dead_[from.first + slot] == 0 || src[to.first + slot] >= 0)) ++slot;
+			if(slot == to.count) break;
+			src[to.first + slot] = from.first + i;
+			++slot;
+		}
+	}
+
+	for(std::vector<float> * v : { &position_x_, &position_y_, &position_z_, &position_w_, &velocity_x_, &velocity_y_, &velocity_z_,
+			&ttl_, &rotation_speed_, &initial_scale_, &final_scale_, &wind_influence_, &gravity_influence_ }) {
+		move_particles(*v, src, 0.f);
+	}
+	move_particles(org_ttl_, src, 1.f);
+	move_particles(texture_index_, src, 0);
+	move_particles(palette_index_, src, (cl_uchar) 0);
+	move_particles(dead_, src, 1);
+
+	//Rebuilt like in the constructor, low indices are popped first
+	for(size_t e=0; e < emitters_.size(); ++e) {
+		free_lists_[e].clear();
+		for(int i=emitters_[e].first + emitters_[e].count - 1; i >= emitters_[e].first; --i) {
+			if(dead_[i] != 0) free_lists_[e].push_back(i);
+		}
+	}
+
+	split_tasks();
+	delete_vertex_buffer();
+	create_vertex_buffer();
+}
+
+void CPUParticleBackend::wait() {
+	//update() is done when it returns
+}
+
+void CPUParticleBackend::update_config(int emitter, const config_t &config) {
+	configs_[emitter] = config;
+}
+
+int CPUParticleBackend::emitter_of(int id) const {
+	size_t e = 0;
+	while(e + 1 < emitters_.size() && emitters_[e + 1].first <= id) ++e;
+	return (int) e;
+}
+
+void CPUParticleBackend::set_hit_targets(const hit_targets_t &targets) {
+	targets_ = targets;
+	targets_.num_enemies = std::min(targets.num_enemies, (cl_uint) max_num_enemies_);
+}
+
+void CPUParticleBackend::set_heightfield(const heightfield_t &heightfield) {
+	if(heightfield.size.x < 2 || heightfield.size.y < 2) return;
+	heightfield_ = heightfield;
+}
+
+const ParticleBackend::enemy_hit_t * CPUParticleBackend::read_hits() {
+	if(!hits_pending_) return nullptr;
+	hits_pending_ = false;
+	return &hits_[0];
+}
+
+static inline cl_uint xorshift(cl_uint &rng) {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+//Set dual to true to get a number in range -m..m (otherwise 0..m), same as in particles_random.cl
+float CPUParticleBackend::random1(float m, bool dual) {
+	return (xorshift(spawn_rng_) >> 8) * (1.f / 16777216.f)*m*(1+dual) - m*dual;
+}
+
+#ifdef __SSE2__
+//Four numbers in range -m..m from a xorshift per lane
+static inline __m128 random_dual(__m128i &rng, float m) {
+	rng = _mm_xor_si128(rng, _mm_slli_epi32(rng, 13));
+	rng = _mm_xor_si128(rng, _mm_srli_epi32(rng, 17));
+	rng = _mm_xor_si128(rng, _mm_slli_epi32(rng, 5));
+	const __m128 r = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(rng, 8)), _mm_set1_ps(1.f / 16777216.f));
+	return _mm_sub_ps(_mm_mul_ps(r, _mm_set1_ps(2.f * m)), _mm_set1_ps(m));
+}
+#endif
+
+void CPUParticleBackend::spawn_particles() {
+	for(const spawn_request_t &request : spawn_requests_) {
+		const config_t &config = spawn_configs_[request.config_index];
+		spawn(request.emitter, config, glm::vec3(config.spawn_position), request.palette_index, request.count);
+	}
+}
+
+void CPUParticleBackend::spawn(int emitter, const config_t &config, const glm::vec3 &origin, cl_uchar palette, int count) {
+	std::vector<int> &free_list = free_lists_[emitter];
+
+	for(int n=0; n < count && !free_list.empty(); ++n) {
+		const int id = free_list.back();
+		free_list.pop_back();
+
+		position_x_[id] = origin.x + random1(config.spawn_area.x, false);
+		position_y_[id] = origin.y + random1(config.spawn_area.y, false);
+		position_z_[id] = origin.z + random1(config.spawn_area.z, false);
+
+		float a = random1(2*M_PI, false);
+		float a2 = random1(2*M_PI, false);
+		float len = random1(config.spawn_area.w, false);
+		position_x_[id] += len * cosf(a);
+		position_y_[id] += len * sinf(a);
+		position_z_[id] += len * sinf(a) * cosf(a2);
+		position_w_[id] = 0.f;
+
+		//Colors and damage are looked up in the palette to allow changing config during runtime
+		palette_index_[id] = palette;
+
+		texture_index_[id] = config.start_texture + (int)floorf(random1((float)(config.num_textures-0.1), false));
+
+		wind_influence_[id] = config.avg_wind_influence + random1(config.wind_influence_var, true);
+		gravity_influence_[id] = config.avg_gravity_influence + random1(config.gravity_influence_var, true);
+
+		velocity_x_[id] = config.avg_spawn_velocity.x + random1(config.spawn_velocity_var.x, true);
+		velocity_y_[id] = config.avg_spawn_velocity.y + random1(config.spawn_velocity_var.y, true);
+		velocity_z_[id] = config.avg_spawn_velocity.z + random1(config.spawn_velocity_var.z, true);
+		org_ttl_[id] = ttl_[id] = config.avg_ttl + random1(config.ttl_var, true);
+		rotation_speed_[id] = config.avg_rotation_speed + random1(config.rotation_speed_var, true);
+		initial_scale_[id] = config.avg_scale + random1(config.scale_var, true);
+		final_scale_[id] = initial_scale_[id] + config.avg_scale_change + random1(config.scale_change_var, true);
+		dead_[id] = 0;
+	}
+}
+
+bool CPUParticleBackend::hit_test(int i, std::vector<enemy_hit_t> &hits) const {
+	//Same as in hitting_particles.cl
+	const float life_progression = 1.f - ttl_[i] / org_ttl_[i];
+	const float scale = initial_scale_[i] + (final_scale_[i] - initial_scale_[i]) * life_progression;
+	const float radius = scale * 0.5f * 0.1f;
+	const glm::vec3 center = glm::vec3(position_x_[i], position_y_[i], position_z_[i]) - glm::vec3(0.5f * 0.1f * scale);
+	const glm::ivec3 cell((int)floorf(center.x / targets_.cell_size), (int)floorf(center.y / targets_.cell_size), (int)floorf(center.z / targets_.cell_size));
+
+	for(int n = 0; n < 27; ++n) {
+		const cl_uint b = grid_hash(cell + glm::ivec3(n % 3 - 1, (n / 3) % 3 - 1, n / 9 - 1), num_buckets_);
+		const cl_int start = targets_.cells[2 * b];
+		const cl_int count = targets_.cells[2 * b + 1];
+		for(int k = 0; k < count; ++k) {
+			const int e = targets_.grid_enemies[start + k];
+			if(glm::distance(center, targets_.enemies[e].position) < targets_.enemies[e].radius + radius) {
+				hits[e].damage += palette_[palette_index_[i]].damage;
+				++hits[e].count;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+//Same as lod_step and lod_interpolate in particles_spawn.cl
+static inline unsigned int lod_step(const ParticleBackend::config_t &config, float distance) {
+	if(config.lod_distances.y > 0 && distance > config.lod_distances.y) return 4;
+	if(config.lod_distances.x > 0 && distance > config.lod_distances.x) return 2;
+	return 1;
+}
+
+static inline bool lod_interpolate(const ParticleBackend::config_t &config, float distance) {
+	return config.lod_distances.z <= 0 || distance < config.lod_distances.z;
+}
+
+//Same as ground_height in particles_spawn.cl
+static float ground_height(const ParticleBackend::heightfield_t &heightfield, float x, float z) {
+	const glm::vec2 p = glm::vec2(x, z) / heightfield.horizontal_scale;
+	if(p.x < 0 || p.y < 0 || p.x > heightfield.size.x || p.y > heightfield.size.y) return 0.f;
+
+	const glm::ivec2 c = glm::min(glm::ivec2(p), heightfield.size - 2);
+	const glm::vec2 d = glm::clamp(p - glm::vec2(c), 0.f, 1.f);
+	const float * h = heightfield.heights + c.y * heightfield.size.x + c.x;
+	const int row = heightfield.size.x;
+	return glm::mix(glm::mix(h[0], h[1], d.x), glm::mix(h[row], h[row + 1], d.x), d.y);
+}
+
+//Same as turbulence_at in particles_spawn.cl, p in cells
+static glm::vec3 turbulence_at(const std::vector<glm::vec4> &field, const glm::vec3 &p) {
+	const int n = ParticleBackend::TURBULENCE_SIZE;
+	const glm::vec3 f = glm::floor(p);
+	const glm::vec3 d = p - f;
+	const glm::ivec3 c0 = glm::ivec3(f) & (n - 1);
+	const glm::ivec3 c1 = (c0 + 1) & (n - 1);
+
+	auto at = [&](int x, int y, int z) { return glm::vec3(field[(z * n + y) * n + x]); };
+	const glm::vec3 y0 = glm::mix(glm::mix(at(c0.x, c0.y, c0.z), at(c1.x, c0.y, c0.z), d.x), glm::mix(at(c0.x, c1.y, c0.z), at(c1.x, c1.y, c0.z), d.x), d.y);
+	const glm::vec3 y1 = glm::mix(glm::mix(at(c0.x, c0.y, c1.z), at(c1.x, c0.y, c1.z), d.x), glm::mix(at(c0.x, c1.y, c1.z), at(c1.x, c1.y, c1.z), d.x), d.y);
+	return glm::mix(y0, y1, d.z);
+}
+
+bool CPUParticleBackend::collide_ground(int i, const config_t &config) {
+	const float h = ground_height(heightfield_, position_x_[i], position_z_[i]);
+	if(position_y_[i] >= h) return true;
+
+	const int response = (int) config.ground.x;
+	if(response == ParticleSystem::GROUND_KILL) return false;
+
+	position_y_[i] = h;
+	if(response == ParticleSystem::GROUND_STICK) {
+		velocity_x_[i] = velocity_y_[i] = velocity_z_[i] = 0.f;
+		return true;
+	}
+
+	//Reflect off the slope, ground.y is the restitution
+	const float s = heightfield_.horizontal_scale;
+	const glm::vec3 n = glm::normalize(glm::vec3(
+				ground_height(heightfield_, position_x_[i] - s, position_z_[i]) - ground_height(heightfield_, position_x_[i] + s, position_z_[i]),
+				2.f * s,
+				ground_height(heightfield_, position_x_[i], position_z_[i] - s) - ground_height(heightfield_, position_x_[i], position_z_[i] + s)));
+	const glm::vec3 v(velocity_x_[i], velocity_y_[i], velocity_z_[i]);
+	const float vn = glm::dot(v, n);
+	if(vn < 0.f) {
+		const glm::vec3 r = v - (1.f + config.ground.y) * vn * n;
+		velocity_x_[i] = r.x;
+		velocity_y_[i] = r.y;
+		velocity_z_[i] = r.z;
+	}
+	return true;
+}
+
+int CPUParticleBackend::run_particles(int begin, int end, const config_t &config, bool test_hits, float dt, unsigned int seed, unsigned int frame,
+		vertex_t * out, std::vector<int> &freed, std::vector<enemy_hit_t> &hits) {
+	int num_live = 0;
+
+	if(test_hits) {
+		//Test before moving, like the kernel
+		for(int i = begin; i < end; ++i) {
+			if(dead_[i] == 0 && hit_test(i, hits)) {
+				dead_[i] = 1;
+				freed.push_back(i);
+			}
+		}
+	}
+
+	const glm::vec4 &gravity = config.gravity;
+	const glm::vec4 &wind = config.wind_velocity;
+	const glm::vec4 &motion_rand = config.motion_rand;
+
+	const bool lod = config.lod_distances != glm::vec4(0.f);
+	const glm::vec3 camera = glm::vec3(config.lod_camera);
+
+	const bool ground = heightfield_.heights != nullptr && (int) config.ground.x != ParticleSystem::GROUND_NONE;
+
+	const bool turbulence = config.turbulence.x != 0.f;
+	const std::vector<glm::vec4> &field = turbulence_field();
+	const glm::vec3 field_offset = glm::vec3(turbulence_offset_);
+	const float cells_per_unit = turbulence_offset_.w;
+
+	//Life progression, time step and color/scale interpolation of the four particles in flight
+	float life[4];
+	float lane_dt[4] = { dt, dt, dt, dt };
+	int interpolate_lanes = 0xf;
+
+	//Distant particles are run every lod_step frames with lod_step * dt, like in the kernels
+	auto set_lod_lanes = [&](int i) {
+		interpolate_lanes = 0;
+		for(int l=0; l < 4; ++l) {
+			const int j = i + l;
+			const float distance = glm::distance(glm::vec3(position_x_[j], position_y_[j], position_z_[j]), camera);
+			const unsigned int step = lod_step(config, distance);
+			lane_dt[l] = ((j + frame) & (step - 1)) == 0 ? dt * step : 0.f;
+			if(lod_interpolate(config, distance)) interpolate_lanes |= 1 << l;
+		}
+	};
+
+#ifdef __SSE2__
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 zero = _mm_setzero_ps();
+
+	__m128i rng = _mm_set_epi32((seed * 2654435761u) | 1u, (seed * 2246822519u) | 1u, (seed * 3266489917u) | 1u, (seed * 668265263u) | 1u);
+
+#define BLEND(mask, a, b) _mm_or_ps(_mm_and_ps((mask), (a)), _mm_andnot_ps((mask), (b)))
+
+	for(int i = begin; i < end; i += 4) {
+		const __m128 alive = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) &dead_[i]), _mm_setzero_si128()));
+		if(_mm_movemask_ps(alive) == 0) continue;
+
+		if(lod) set_lod_lanes(i);
+		const __m128 v_dt = _mm_loadu_ps(lane_dt);
+
+		const __m128 old_ttl = _mm_loadu_ps(&ttl_[i]);
+		const __m128 ttl = _mm_sub_ps(old_ttl, v_dt);
+		_mm_storeu_ps(&ttl_[i], BLEND(alive, ttl, old_ttl));
+
+		const __m128 is_live = _mm_and_ps(alive, _mm_cmpgt_ps(ttl, zero));
+		_mm_storeu_ps(life, _mm_sub_ps(one, _mm_div_ps(ttl, _mm_loadu_ps(&org_ttl_[i]))));
+
+		//Lanes with a zero time step are left as they are, skip the work if that is all of them
+		if(_mm_movemask_ps(_mm_cmpgt_ps(v_dt, zero)) != 0) {
+			const __m128 gravity_dt = _mm_mul_ps(_mm_loadu_ps(&gravity_influence_[i]), v_dt);
+			const __m128 wind_dt = _mm_mul_ps(_mm_loadu_ps(&wind_influence_[i]), v_dt);
+
+			float * velocity[3] = { &velocity_x_[i], &velocity_y_[i], &velocity_z_[i] };
+			float * position[3] = { &position_x_[i], &position_y_[i], &position_z_[i] };
+			for(int c=0; c < 3; ++c) {
+				const __m128 old_velocity = _mm_loadu_ps(velocity[c]);
+				__m128 v = _mm_add_ps(old_velocity, _mm_mul_ps(_mm_set1_ps(gravity[c]), gravity_dt));
+				v = _mm_sub_ps(v, _mm_mul_ps(_mm_sub_ps(v, _mm_set1_ps(wind[c])), wind_dt));
+				_mm_storeu_ps(velocity[c], BLEND(is_live, v, old_velocity));
+
+				const __m128 old_position = _mm_loadu_ps(position[c]);
+				const __m128 p = _mm_add_ps(old_position, _mm_mul_ps(_mm_add_ps(v, random_dual(rng, motion_rand[c])), v_dt));
+				_mm_storeu_ps(position[c], BLEND(is_live, p, old_position));
+			}
+
+			const __m128 old_rotation = _mm_loadu_ps(&position_w_[i]);
+			const __m128 rotation = _mm_add_ps(old_rotation, _mm_mul_ps(_mm_loadu_ps(&rotation_speed_[i]), v_dt));
+			_mm_storeu_ps(&position_w_[i], BLEND(is_live, rotation, old_rotation));
+		}
+
+		const int lanes = _mm_movemask_ps(alive);
+		int live_lanes = _mm_movemask_ps(is_live);
+#else
+	cl_uint rng = (seed * 2654435761u) | 1u;
+
+	for(int i = begin; i < end; i += 4) {
+		int lanes = 0, live_lanes = 0;
+		if(lod) set_lod_lanes(i);
+		for(int l=0; l < 4; ++l) {
+			const int j = i + l;
+			if(dead_[j] != 0) continue;
+			lanes |= 1 << l;
+
+			const float step_dt = lane_dt[l];
+			ttl_[j] -= step_dt;
+			life[l] = 1.f - ttl_[j] / org_ttl_[j];
+			if(ttl_[j] <= 0.f) continue;
+			live_lanes |= 1 << l;
+			if(step_dt == 0.f) continue;
+
+			float * velocity[3] = { &velocity_x_[j], &velocity_y_[j], &velocity_z_[j] };
+			float * position[3] = { &position_x_[j], &position_y_[j], &position_z_[j] };
+			for(int c=0; c < 3; ++c) {
+				*velocity[c] += gravity[c] * gravity_influence_[j] * step_dt;
+				*velocity[c] -= (*velocity[c] - wind[c]) * wind_influence_[j] * step_dt;
+				*position[c] += (*velocity[c] + (xorshift(rng) >> 8) * (1.f / 16777216.f) * 2.f * motion_rand[c] - motion_rand[c]) * step_dt;
+			}
+			position_w_[j] += rotation_speed_[j] * step_dt;
+		}
+#endif
+
+		//Carried along by the field, after the integration like in the kernels
+		if(turbulence) {
+			for(int l=0; l < 4; ++l) {
+				if((live_lanes & (1 << l)) == 0 || lane_dt[l] == 0.f) continue;
+				const int j = i + l;
+				const glm::vec3 p(position_x_[j], position_y_[j], position_z_[j]);
+				const glm::vec3 v = turbulence_at(field, (p + field_offset) * cells_per_unit) * config.turbulence.x * lane_dt[l];
+				position_x_[j] += v.x;
+				position_y_[j] += v.y;
+				position_z_[j] += v.z;
+			}
+		}
+
+		//Only the particles that moved can have hit the ground
+		if(ground) {
+			for(int l=0; l < 4; ++l) {
+				if((live_lanes & (1 << l)) == 0 || lane_dt[l] == 0.f) continue;
+				if(!collide_ground(i + l, config)) {
+					ttl_[i + l] = 0.f;
+					live_lanes &= ~(1 << l);
+				}
+			}
+		}
+
+		//Write the live particles and free the ones that died this frame
+		for(int l=0; l < 4; ++l) {
+			if((lanes & (1 << l)) == 0) continue;
+			const int j = i + l;
+			if(live_lanes & (1 << l)) {
+				vertex_t &v = out[num_live++];
+				v.position = glm::vec4(position_x_[j], position_y_[j], position_z_[j], position_w_[j]);
+				const palette_entry_t &p = palette_[palette_index_[j]];
+				//Past the fog the particles keep their birth color and initial scale
+				const float progression = (interpolate_lanes & (1 << l)) ? life[l] : 0.f;
+				const glm::vec4 color = glm::clamp(p.birth_color + (p.death_color - p.birth_color) * progression, 0.f, 1.f);
+				for(int c=0; c < 4; ++c) {
+					v.color[c] = (cl_uchar) (color[c] * 255.f + 0.5f);
+				}
+				v.scale = float_to_half(initial_scale_[j] + (final_scale_[j] - initial_scale_[j]) * progression);
+				v.texture_index = (cl_ushort) texture_index_[j];
+			} else {
+				dead_[j] = 1;
+				freed.push_back(j);
+			}
+		}
+	}
+
+#ifdef __SSE2__
+#undef BLEND
+#endif
+
+	return num_live;
+}
+
+CPUParticleBackend::vertex_t * CPUParticleBackend::map_region() {
+	region_ = (region_ + 1) % NUM_REGIONS;
+
+	//Wait for gl to be done drawing what was last written here
+	GLsync &fence = region_fence_[region_];
+	if(fence != nullptr) {
+		while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) { }
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+
+	if(persistent_) return mapped_ + region_ * region_stride_;
+
+	glBindBuffer(GL_ARRAY_BUFFER, gl_buffer_);
+	vertex_t * region = (vertex_t*) glMapBufferRange(GL_ARRAY_BUFFER, sizeof(vertex_t) * region_stride_ * region_, sizeof(vertex_t) * region_stride_,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	if(region == nullptr) {
+		fprintf(stderr, "[ParticleSystem] Failed to map vertex buffer\n");
+		util_abort();
+	}
+	return region;
+}
+
+void CPUParticleBackend::unmap_region() {
+	if(persistent_) return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, gl_buffer_);
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void CPUParticleBackend::update(float dt) {
+	std::vector<cl_int> free_counts(emitters_.size());
+	for(size_t e=0; e < emitters_.size(); ++e) {
+		free_counts[e] = (cl_int) free_lists_[e].size();
+	}
+	resize_pool(free_counts);
+
+	spawn_particles();
+
+	vertex_t * out = map_region();
+
+	const int padded_size = (int) dead_.size();
+	const bool test_hits = targets_.num_enemies > 0;
+	const unsigned int frame = frame_++;
+
+	workers->run(num_tasks_, [&](int t) {
+		const int begin = t * task_size_;
+		const int end = std::min(begin + task_size_, padded_size);
+
+		task_freed_[t].clear();
+		if(test_hits) task_hits_[t].assign(targets_.num_enemies, enemy_hit_t());
+
+		//Vertices of a part are written to the start of its own range
+		draw_first_[t] = region_ * region_stride_ + begin;
+		draw_count_[t] = 0;
+
+		//Each emitter runs with its own config
+		const unsigned int num_emitters = (unsigned int) emitters_.size();
+		for(unsigned int e = 0; e < num_emitters; ++e) {
+			const int first = std::max(begin, emitters_[e].first);
+			const int last = std::min(end, emitters_[e].first + emitters_[e].count);
+			if(first >= last) continue;
+
+			const unsigned int seed = seed_ + (frame * num_tasks_ + t) * num_emitters + e;
+			draw_count_[t] += run_particles(first, last, configs_[e], test_hits && emitters_[e].hit_test, dt, seed, frame,
+					out + begin + draw_count_[t], task_freed_[t], task_hits_[t]);
+		}
+	});
+
+	unmap_region();
+
+	for(const std::vector<int> &freed : task_freed_) {
+		for(int id : freed) {
+			free_lists_[emitter_of(id)].push_back(id);
+		}
+	}
+
+	if(test_hits) {
+		for(cl_uint e = 0; e < targets_.num_enemies; ++e) {
+			hits_[e] = enemy_hit_t();
+			for(const std::vector<enemy_hit_t> &task_hits : task_hits_) {
+				hits_[e].damage += task_hits[e].damage;
+				hits_[e].count += task_hits[e].count;
+			}
+		}
+		hits_pending_ = true;
+
+		//Same as spawn_impacts in hitting_particles.cl
+		if(targets_.impact_config != nullptr && targets_.impact_count > 0) {
+			const cl_uchar palette = palette_index(*targets_.impact_config);
+			for(cl_uint e = 0; e < targets_.num_enemies; ++e) {
+				if(hits_[e].count == 0) continue;
+				spawn(targets_.impact_emitter, *targets_.impact_config, targets_.enemies[e].position, palette, (int) targets_.impact_count);
+			}
+		}
+	}
+}
+
+void CPUParticleBackend::draw() {
+	glBindBuffer(GL_ARRAY_BUFFER, gl_buffer_);
+
+	vertex_attrib_pointers();
+
+	glMultiDrawArrays(GL_POINTS, &draw_first_[0], &draw_count_[0], num_tasks_);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//The region may not be written again before gl is done with it
+	GLsync &fence = region_fence_[region_];
+	if(fence != nullptr) glDeleteSync(fence);
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
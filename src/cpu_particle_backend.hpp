@@ -0,0 +1,136 @@
+#ifndef CPU_PARTICLE_BACKEND_HPP
+#define CPU_PARTICLE_BACKEND_HPP
+
+#include "particle_backend.hpp"
+
+#include <GL/glew.h>
+#include <vector>
+
+/*
+ * Runs the particles on the cpu, for when OpenCL is missing or slow.
+ * The particles are stored as structure of arrays and updated with SSE on all worker threads,
+ * the live vertices are written straight into a (persistently if possible) mapped gl buffer.
+ */
+class CPUParticleBackend : public ParticleBackend {
+	public:
+		CPUParticleBackend(const std::vector<emitter_t> &emitters, int max_num_enemies);
+		virtual ~CPUParticleBackend();
+
+		virtual void wait();
+		virtual void update(float dt);
+		virtual void update_config(int emitter, const config_t &config);
+		virtual void set_hit_targets(const hit_targets_t &targets);
+		virtual void set_heightfield(const heightfield_t &heightfield);
+		virtual const enemy_hit_t * read_hits();
+		virtual void draw();
+
+		//Number of threads to run the particles on (including the main thread), 0 means one per core
+		static unsigned int num_threads;
+
+	protected:
+		virtual void apply_layout(const std::vector<emitter_t> &old_layout);
+
+	private:
+		void spawn_particles();
+
+		/*
+		 * Spawn count particles of emitter with config around origin
+		 */
+		void spawn(int emitter, const config_t &config, const glm::vec3 &origin, cl_uchar palette, int count);
+
+		/*
+		 * Random number from spawn_rng_ in range -m..m if dual, otherwise 0..m
+		 */
+		float random1(float m, bool dual);
+
+		/*
+		 * Run the particles in [begin, end) of one emitter, write the live ones to out and return how many they are.
+		 * begin must be a multiple of four. Dead particles are added to freed, hits to hits.
+		 * frame spreads the distant particles over the frames, see config_t::lod_distances
+		 */
+		int run_particles(int begin, int end, const config_t &config, bool test_hits, float dt, unsigned int seed, unsigned int frame,
+				vertex_t * out, std::vector<int> &freed, std::vector<enemy_hit_t> &hits);
+
+		/*
+		 * Index of the emitter owning particle id
+		 */
+		int emitter_of(int id) const;
+
+		/*
+		 * Test particle i against the hit targets, adds its damage to hits if it hit something
+		 */
+		bool hit_test(int i, std::vector<enemy_hit_t> &hits) const;
+
+		/*
+		 * Split the pool in num_tasks_ parts for the workers
+		 */
+		void split_tasks();
+
+		/*
+		 * The vertex buffer has room for the pool, it is replaced when the pool is resized
+		 */
+		void create_vertex_buffer();
+		void delete_vertex_buffer();
+
+		/*
+		 * Map the next region of the vertex buffer for writing
+		 */
+		vertex_t * map_region();
+		void unmap_region();
+
+		// Particle state, one array per member so four particles can be updated at once.
+		// position_w is the rotation.
+		std::vector<float> position_x_, position_y_, position_z_, position_w_;
+		std::vector<float> velocity_x_, velocity_y_, velocity_z_;
+		std::vector<float> ttl_, org_ttl_, rotation_speed_, initial_scale_, final_scale_;
+		std::vector<float> wind_influence_, gravity_influence_;
+		std::vector<int> texture_index_, dead_;
+		std::vector<cl_uchar> palette_index_; //Colors and damage, see ParticleBackend::palette_
+
+		//Indices of dead particles of each emitter
+		std::vector<std::vector<int> > free_lists_;
+
+		std::vector<config_t> configs_; //One per emitter
+		unsigned int frame_;
+
+		//Xorshift state for spawning, the update streams are seeded from seed_ and frame_
+		cl_uint spawn_rng_;
+
+		/*
+		 * The vertex buffer holds NUM_REGIONS regions of region_stride_ vertices, the size of the pool when it was created.
+		 * Each update writes the next region, a fence per region tells when gl is done drawing it.
+		 */
+		enum { NUM_REGIONS = 3 };
+
+		GLuint gl_buffer_;
+		bool persistent_; //ARB_buffer_storage, the buffer is mapped once
+		vertex_t * mapped_;
+		GLsync region_fence_[NUM_REGIONS];
+		int region_;
+		int region_stride_;
+
+		//Each task writes its live particles to the start of its own range, the ranges are drawn with glMultiDrawArrays
+		int num_tasks_, task_size_;
+		std::vector<GLint> draw_first_;
+		std::vector<GLsizei> draw_count_;
+		std::vector<std::vector<int> > task_freed_;
+		std::vector<std::vector<enemy_hit_t> > task_hits_;
+
+		//Hit test, only with max_num_enemies > 0
+		const int max_num_enemies_;
+		const cl_uint num_buckets_;
+		hit_targets_t targets_;
+		std::vector<enemy_hit_t> hits_;
+		bool hits_pending_;
+
+		/*
+		 * Ground contact of particle i after it moved, see config_t::ground.
+		 * Returns false if the ground kills it
+		 */
+		bool collide_ground(int i, const config_t &config);
+
+		//heights is nullptr without terrain
+		heightfield_t heightfield_;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dust.hpp"
+#include "config.hpp"
+#include "gl_state.hpp"
+#include "globals.hpp"
+#include "shader.hpp"
+#include "texture.hpp"
+#include "utils.hpp"
+
+#include <glm/gtc/type_ptr.hpp>
+
+Dust::Dust(const ConfigEntry * config, TextureArray * texture)
+	: texture_(texture)
+	, drift_(0.f) {
+
+	num_cells_ = glm::ivec3(config->find("num_cells", true)->as_vec3());
+	wind_influence_ = config->find("wind_influence", true)->as_float();
+	gravity_influence_ = config->find("gravity_influence", true)->as_float();
+
+	shader_ = Shader::create_shader("dust");
+	u_drift_ = shader_->uniform_location("drift");
+
+	//Everything but the drift is constant
+	shader_->bind();
+	glUniform3iv(shader_->uniform_location("num_cells"), 1, glm::value_ptr(num_cells_));
+	glUniform1f(shader_->uniform_location("cell_size"), config->find("cell_size", true)->as_float());
+	glUniform4fv(shader_->uniform_location("birth_color"), 1, glm::value_ptr(config->find("birth_color", true)->as_vec4()));
+	glUniform4fv(shader_->uniform_location("death_color"), 1, glm::value_ptr(config->find("death_color", true)->as_vec4()));
+	glUniform2f(shader_->uniform_location("ttl"), config->find("avg_ttl", true)->as_float(), config->find("ttl_var", true)->as_float());
+	glUniform2f(shader_->uniform_location("scale"), config->find("avg_scale", true)->as_float(), config->find("scale_var", true)->as_float());
+	glUniform2f(shader_->uniform_location("scale_change"), config->find("avg_scale_change", true)->as_float(), config->find("scale_change_var", true)->as_float());
+	glUniform2f(shader_->uniform_location("rotation_speed"), config->find("avg_rotation_speed", true)->as_float(), config->find("rotation_speed_var", true)->as_float());
+	glUniform3fv(shader_->uniform_location("motion_rand"), 1, glm::value_ptr(config->find("motion_rand", true)->as_vec3()));
+	glUniform2i(shader_->uniform_location("textures"), config->find("start_texture", true)->as_int(), config->find("num_textures", true)->as_int());
+	Shader::unbind();
+
+	checkForGLErrors("[Dust] Set uniforms");
+
+	fprintf(verbose, "Created dust with %d motes\n", num_cells_.x * num_cells_.y * num_cells_.z);
+}
+
+void Dust::update(float dt, const glm::vec3 &wind_velocity, const glm::vec3 &gravity) {
+	//Where the velocity of a ParticleSystem particle settles: gravity and wind drag cancel out
+	const glm::vec3 fall = wind_influence_ > 0.f ? gravity * gravity_influence_ / wind_influence_ : glm::vec3(0.f);
+	drift_ += (wind_velocity + fall) * dt;
+}
+
+void Dust::render() const {
+	shader_->bind();
+	glUniform3fv(u_drift_, 1, glm::value_ptr(drift_));
+
+	//No vertex data, the motes are made up from gl_VertexID
+	Shader::push_vertex_attribs();
+
+	GLState::push_attrib(GL_ENABLE_BIT|GL_DEPTH_BUFFER_BIT);
+
+	GLState::depth_mask(GL_FALSE);
+	GLState::disable(GL_CULL_FACE);
+
+	Shader::upload_model_matrix(glm::mat4(1.f));
+
+	texture_->texture_bind(Shader::TEXTURE_ARRAY_0);
+
+	glDrawArrays(GL_POINTS, 0, num_cells_.x * num_cells_.y * num_cells_.z);
+
+	GLState::pop_attrib();
+
+	Shader::pop_vertex_attribs();
+
+	checkForGLErrors("[Dust] Render");
+}
@@ -0,0 +1,44 @@
+#ifndef DUST_HPP
+#define DUST_HPP
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+class ConfigEntry;
+
+/*
+ * Ambient dust, generated in the vertex shader (shaders/dust.vert) without any per mote state.
+ * One mote sits in each cell of a lattice around the camera, the lattice drifts with the wind
+ * and each mote is reborn at a new place in its cell when its ttl runs out.
+ * Drawn with the particle geometry and fragment shaders, so it looks like a ParticleSystem.
+ */
+class Dust {
+	public:
+		/*
+		 * config is the dust entry in particles.cfg, texture the particle texture array
+		 */
+		Dust(const ConfigEntry * config, TextureArray * texture);
+
+		/*
+		 * Carry the dust with the wind. Gravity pulls it down at the speed where
+		 * it balances the drag of the wind.
+		 */
+		void update(float dt, const glm::vec3 &wind_velocity, const glm::vec3 &gravity);
+
+		/*
+		 * Draw all motes, the particle depth texture must be bound like for ParticleWorld::render
+		 */
+		void render() const;
+
+	private:
+		Shader * shader_;
+		TextureArray * texture_;
+
+		glm::ivec3 num_cells_;
+		float wind_influence_, gravity_influence_;
+
+		glm::vec3 drift_;
+		GLint u_drift_;
+};
+
+#endif
@@ -14,8 +14,6 @@ Enemy::Enemy(const glm::vec3 &position, const RenderObject * model_, const Enemy
 	, ai(ai_)
 	, fly_in(2.0)
 	{
-		hp_shader = Shader::create_shader("health");
-		enemy_shader = Shader::create_shader("normal");
 }
 
 void Enemy::update(float dt) {
@@ -37,24 +35,16 @@ void Enemy::render_geometry() const {
 	model->render(matrix());
 }
 
-void Enemy::render() const {
-	enemy_shader->bind();
-	render_geometry();
-	hp_shader->bind();
-
-	Shader::upload_model_matrix(matrix());
-
-	float life = glm::clamp(hp/initial_hp, 0.f, 1.f);
-	float scale = life * scale_.x;
-	Shader::push_vertex_attribs(2);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, 0, &life);
-	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, &scale);
-
-	glDrawArrays(GL_POINTS, 0, 1);
-
-	Shader::pop_vertex_attribs();
+const RenderObject * Enemy::render_object() const {
+	return model;
+}
 
+HealthBars::bar_t Enemy::health_bar() const {
+	HealthBars::bar_t bar;
+	bar.position = glm::vec3(matrix() * glm::vec4(0.f, 1.f, 0.f, 1.f));
+	bar.life = glm::clamp(hp/initial_hp, 0.f, 1.f);
+	bar.scale = bar.life * scale_.x;
+	return bar;
 }
 
 void Enemy::set_hp(float _hp) {
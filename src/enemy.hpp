@@ -3,6 +3,7 @@
 
 #include "movable_object.hpp"
 #include "enemy_template.hpp"
+#include "health_bars.hpp"
 #include "config.hpp"
 #include <glm/glm.hpp>
 
@@ -11,8 +12,11 @@ class Enemy : public MovableObject {
 		Enemy(const glm::vec3 &position, const RenderObject * model_, const EnemyAI * ai_);
 
 		void update(float dt);
-		void render() const;
+		//The model and health bar are drawn by Game with the other enemies, see InstancedModels and HealthBars
 		void render_geometry() const;
+		HealthBars::bar_t health_bar() const;
+
+		const RenderObject * render_object() const;
 
 		float hp;
 		float initial_hp;
@@ -29,7 +33,6 @@ class Enemy : public MovableObject {
 		const EnemyAI * ai;
 
 		float fly_in;
-		Shader * hp_shader, *enemy_shader;
 };
 
 #endif
@@ -3,6 +3,7 @@
 #endif
 
 #include "engine.hpp"
+#include "gl_state.hpp"
 #include "globals.hpp"
 #include "shader.hpp"
 #include "utils.hpp"
@@ -10,6 +11,10 @@
 #include "sound.hpp"
 #include "game.hpp" 
 #include "config.hpp"
+#include "cpu_particle_backend.hpp"
+#include "explosion_flipbooks.hpp"
+
+#include <algorithm>
 
 CL * opencl;
 
@@ -51,15 +56,15 @@ namespace Engine {
 	Game * game;
 
 	void setup_opengl(){
-		glEnable(GL_CULL_FACE);
-		glEnable(GL_DEPTH_TEST);
+		GLState::enable(GL_CULL_FACE);
+		GLState::enable(GL_DEPTH_TEST);
 		glEnable(GL_TEXTURE_2D);
 		glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
-		glEnable(GL_BLEND);
+		GLState::enable(GL_BLEND);
 		glCullFace(GL_BACK);
 		glDepthFunc(GL_LEQUAL);
-		glDepthMask(GL_TRUE);
-		glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+		GLState::depth_mask(GL_TRUE);
+		GLState::blend_func(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
 	}
 
 	void load_shaders() {
@@ -85,11 +90,33 @@ namespace Engine {
 		Shader::fog_t fog = { glm::vec4(0.584f, 0.698f, 0.698f, 1.f), 0.005f };
 		Shader::upload_fog(fog);
 		srand(util_utime());
-		opencl = new CL();
+		Config config = Config::parse(PATH_BASE "/data/graphics.cfg");
 
-		render_loading_scene();
+		const std::string &particle_backend = config["/particles/backend"]->as_string();
+		CPUParticleBackend::num_threads = config["/particles/threads"]->as_int();
+		ParticleBackend::seed = (cl_uint) config["/particles/seed"]->as_int();
+		if(particle_backend == "opencl") {
+			opencl = new CL(config["/opencl/platform"]->as_string(), config["/opencl/device"]->as_string());
+			if(!opencl->available()) {
+				fprintf(stderr, "[OpenCL] Not available, running particles on the cpu\n");
+				delete opencl;
+				opencl = nullptr;
+			}
+		} else if(particle_backend != "cpu") {
+			fprintf(stderr, "Unknown particle backend %s, must be opencl or cpu\n", particle_backend.c_str());
+			util_abort();
+		}
 
-		Config config = Config::parse(PATH_BASE "/data/graphics.cfg");
+		const std::string &explosions = config["/particles/explosions"]->as_string();
+		if(explosions != "flipbook" && explosions != "simulated") {
+			fprintf(stderr, "Unknown explosions %s, must be flipbook or simulated\n", explosions.c_str());
+			util_abort();
+		}
+		ExplosionFlipbooks::enabled = explosions == "flipbook";
+		ExplosionFlipbooks::num_frames = std::max(config["/particles/flipbook_frames"]->as_int(), 2);
+		ExplosionFlipbooks::resolution = config["/particles/flipbook_resolution"]->as_int();
+
+		render_loading_scene();
 
 		MovableLight::shadowmap_resolution = glm::ivec2(config["/shadowmap/resolution"]->as_vec2());
 		MovableLight::shadowmap_far_factor = config["/shadowmap/far_factor"]->as_float();
@@ -0,0 +1,253 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "explosion_flipbooks.hpp"
+#include "particle_backend.hpp"
+#include "globals.hpp"
+#include "gl_state.hpp"
+#include "shader.hpp"
+#include "texture.hpp"
+#include "utils.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+bool ExplosionFlipbooks::enabled = false;
+int ExplosionFlipbooks::num_frames = 32;
+int ExplosionFlipbooks::resolution = 128;
+
+//Simulation steps between two frames of the bake
+static const int bake_substeps = 4;
+
+ExplosionFlipbooks::ExplosionFlipbooks(const std::vector<type_t> &types, TextureArray * particle_textures) {
+	//One layer per frame of each type
+	glGenTextures(1, &texture_);
+	GLState::bind_texture(GL_TEXTURE_2D_ARRAY, texture_);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, resolution, resolution, num_frames * (GLsizei) types.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	GLState::bind_texture(GL_TEXTURE_2D_ARRAY, 0);
+	checkForGLErrors("[ExplosionFlipbooks] Create texture array");
+
+	GLuint fbo, bake_vbo;
+	glGenFramebuffers(1, &fbo);
+	glGenBuffers(1, &bake_vbo);
+
+	GLint previous_fbo;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous_fbo);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	for(size_t t = 0; t < types.size(); ++t) {
+		flipbooks_.push_back(bake(types[t], (int) t * num_frames, particle_textures, fbo, bake_vbo));
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, previous_fbo);
+
+	glDeleteBuffers(1, &bake_vbo);
+	glDeleteFramebuffers(1, &fbo);
+
+	GLState::bind_texture(GL_TEXTURE_2D_ARRAY, texture_);
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	GLState::bind_texture(GL_TEXTURE_2D_ARRAY, 0);
+	checkForGLErrors("[ExplosionFlipbooks] Bake");
+
+	shader_ = Shader::create_shader("flipbook");
+	glGenBuffers(1, &vbo_);
+
+	fprintf(verbose, "Baked %lu explosion flipbooks of %d frames at %dx%d\n", (unsigned long) types.size(), num_frames, resolution, resolution);
+}
+
+ExplosionFlipbooks::~ExplosionFlipbooks() {
+	glDeleteBuffers(1, &vbo_);
+	GLState::delete_textures(1, &texture_);
+}
+
+//Set dual to true to get a number in range -m..m (otherwise 0..m), like the particle backends
+static float random1(float m, bool dual) {
+	return frand()*m*(1+dual) - m*dual;
+}
+
+ExplosionFlipbooks::flipbook_t ExplosionFlipbooks::bake(const type_t &t, int first_layer, TextureArray * particle_textures, GLuint fbo, GLuint vbo) {
+	const ParticleSystem::config_t &config = t.config;
+
+	//Same state and spawn as in the particle backends, around origo
+	struct particle_t {
+		glm::vec3 position, velocity;
+		float rotation, rotation_speed;
+		float ttl, org_ttl;
+		float initial_scale, final_scale;
+		float wind_influence, gravity_influence;
+		int texture_index;
+	};
+
+	std::vector<particle_t> particles(t.count);
+	float duration = 0.f;
+	for(particle_t &p : particles) {
+		p.position = glm::vec3(random1(config.spawn_area.x, false), random1(config.spawn_area.y, false), random1(config.spawn_area.z, false));
+		const float a = random1(2*M_PI, false);
+		const float a2 = random1(2*M_PI, false);
+		const float len = random1(config.spawn_area.w, false);
+		p.position += len * glm::vec3(cosf(a), sinf(a), sinf(a) * cosf(a2));
+		p.rotation = 0.f;
+
+		p.texture_index = config.start_texture + (int)floorf(random1((float)(config.num_textures-0.1), false));
+		p.wind_influence = config.avg_wind_influence + random1(config.wind_influence_var, true);
+		p.gravity_influence = config.avg_gravity_influence + random1(config.gravity_influence_var, true);
+		p.velocity = glm::vec3(config.avg_spawn_velocity) + glm::vec3(random1(config.spawn_velocity_var.x, true), random1(config.spawn_velocity_var.y, true), random1(config.spawn_velocity_var.z, true));
+		p.rotation_speed = config.avg_rotation_speed + random1(config.rotation_speed_var, true);
+		p.org_ttl = p.ttl = std::max(config.avg_ttl + random1(config.ttl_var, true), 0.001f);
+		p.initial_scale = config.avg_scale + random1(config.scale_var, true);
+		p.final_scale = p.initial_scale + config.avg_scale_change + random1(config.scale_change_var, true);
+
+		duration = std::max(duration, p.org_ttl);
+	}
+
+	//Run and keep the vertices of the live particles at each frame
+	const float dt = duration / (num_frames - 1) / bake_substeps;
+	std::vector<std::vector<ParticleBackend::vertex_t> > frames(num_frames);
+	float radius = 0.f;
+	for(int f = 0; f < num_frames; ++f) {
+		for(int step = 0; f > 0 && step < bake_substeps; ++step) {
+			for(particle_t &p : particles) {
+				if(p.ttl <= 0.f) continue;
+				p.ttl -= dt;
+				p.velocity += glm::vec3(config.gravity) * p.gravity_influence * dt;
+				p.velocity -= (p.velocity - glm::vec3(config.wind_velocity)) * p.wind_influence * dt;
+				p.position += (p.velocity + glm::vec3(random1(config.motion_rand.x, true), random1(config.motion_rand.y, true), random1(config.motion_rand.z, true))) * dt;
+				p.rotation += p.rotation_speed * dt;
+			}
+		}
+
+		for(const particle_t &p : particles) {
+			if(p.ttl <= 0.f) continue;
+			const float life_progression = 1.f - p.ttl / p.org_ttl;
+			const float scale = p.initial_scale + (p.final_scale - p.initial_scale) * life_progression;
+			const glm::vec4 color = glm::clamp(config.birth_color + (config.death_color - config.birth_color) * life_progression, 0.f, 1.f);
+
+			ParticleBackend::vertex_t v;
+			v.position = glm::vec4(p.position, p.rotation);
+			for(int c=0; c < 4; ++c) {
+				v.color[c] = (cl_uchar) (color[c] * 255.f + 0.5f);
+			}
+			v.scale = ParticleBackend::float_to_half(scale);
+			v.texture_index = (cl_ushort) p.texture_index;
+			frames[f].push_back(v);
+
+			//The quad of a particle is 0.1 * scale to its sides, seen from the front, see particles.geom
+			radius = std::max(radius, std::max(fabsf(p.position.x), fabsf(p.position.y)) + 0.1f * fabsf(scale) * sqrtf(2.f));
+		}
+	}
+	radius = std::max(radius, 0.001f);
+
+	//Render the frames seen from the front, the colors are premultiplied with the alpha
+	Shader * bake_shader = Shader::create_shader("flipbook_bake");
+	bake_shader->bind();
+	Shader::upload_projection_view_matrices(glm::ortho(-radius, radius, -radius, radius, -1000.f, 1000.f), glm::mat4(1.f));
+	Shader::upload_model_matrix(glm::mat4(1.f));
+	particle_textures->texture_bind(Shader::TEXTURE_ARRAY_0);
+
+	Shader::push_vertex_attribs();
+	GLState::push_attrib(GL_ENABLE_BIT|GL_DEPTH_BUFFER_BIT|GL_COLOR_BUFFER_BIT|GL_VIEWPORT_BIT);
+
+	glViewport(0, 0, resolution, resolution);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
+	GLState::enable(GL_BLEND);
+	GLState::blend_func_separate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	ParticleBackend::vertex_attrib_pointers();
+
+	for(int f = 0; f < num_frames; ++f) {
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture_, 0, first_layer + f);
+		glClear(GL_COLOR_BUFFER_BIT);
+		if(frames[f].empty()) continue;
+
+		glBufferData(GL_ARRAY_BUFFER, sizeof(ParticleBackend::vertex_t) * frames[f].size(), &frames[f][0], GL_STREAM_DRAW);
+		glDrawArrays(GL_POINTS, 0, (GLsizei) frames[f].size());
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	GLState::pop_attrib();
+	Shader::pop_vertex_attribs();
+
+	checkForGLErrors("[ExplosionFlipbooks] Render frames");
+
+	flipbook_t flipbook;
+	flipbook.duration = duration;
+	flipbook.radius = radius;
+	flipbook.rotate = config.avg_gravity_influence == 0.f && config.gravity_influence_var == 0.f
+		&& config.avg_wind_influence == 0.f && config.wind_influence_var == 0.f;
+	return flipbook;
+}
+
+void ExplosionFlipbooks::spawn(int type, const glm::vec3 &position) {
+	explosion_t e;
+	e.position = position;
+	e.age = 0.f;
+	e.type = type;
+	//Hides that all explosions of a type are the same
+	e.rotation = flipbooks_[type].rotate ? random1(2*M_PI, false) : 0.f;
+	explosions_.push_back(e);
+}
+
+void ExplosionFlipbooks::update(float dt) {
+	for(explosion_t &e : explosions_) {
+		e.age += dt;
+	}
+	explosions_.erase(std::remove_if(explosions_.begin(), explosions_.end(), [this](const explosion_t &e) {
+		return e.age >= flipbooks_[e.type].duration;
+	}), explosions_.end());
+}
+
+void ExplosionFlipbooks::render() {
+	if(explosions_.empty()) return;
+
+	vertices_.clear();
+	for(const explosion_t &e : explosions_) {
+		const flipbook_t &flipbook = flipbooks_[e.type];
+		vertex_t v;
+		v.position = glm::vec4(e.position, flipbook.radius);
+		v.frame = e.type * num_frames + std::min(e.age / flipbook.duration, 1.f) * (num_frames - 1);
+		v.rotation = e.rotation;
+		vertices_.push_back(v);
+	}
+
+	shader_->bind();
+
+	Shader::push_vertex_attribs();
+	GLState::push_attrib(GL_ENABLE_BIT|GL_DEPTH_BUFFER_BIT|GL_COLOR_BUFFER_BIT);
+
+	GLState::depth_mask(GL_FALSE);
+	GLState::disable(GL_CULL_FACE);
+	//The baked colors are premultiplied
+	GLState::blend_func(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	Shader::upload_model_matrix(glm::mat4(1.f));
+
+	GLState::bind_texture(Shader::TEXTURE_ARRAY_0, GL_TEXTURE_2D_ARRAY, texture_);
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_t) * vertices_.size(), &vertices_[0], GL_STREAM_DRAW);
+
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (GLvoid*) offsetof(vertex_t, position));
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (GLvoid*) offsetof(vertex_t, frame));
+
+	glDrawArrays(GL_POINTS, 0, (GLsizei) vertices_.size());
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	GLState::pop_attrib();
+	Shader::pop_vertex_attribs();
+
+	checkForGLErrors("[ExplosionFlipbooks] Render");
+}
@@ -0,0 +1,85 @@
+#ifndef EXPLOSION_FLIPBOOKS_HPP
+#define EXPLOSION_FLIPBOOKS_HPP
+
+#include "particle_system.hpp"
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+
+/*
+ * Explosions pre-baked to flipbooks: when created each explosion type is simulated once,
+ * like a ParticleSystem spawning count particles with its config, and every frame of it is rendered
+ * to a layer of a texture array. An explosion is then a single animated billboard,
+ * all of them are drawn in one batch.
+ */
+class ExplosionFlipbooks {
+	public:
+		struct type_t {
+			ParticleSystem::config_t config;
+			int count;
+		};
+
+		/*
+		 * Bakes all types, the index in types is used in spawn().
+		 * particle_textures is the texture array the configs refer to.
+		 */
+		ExplosionFlipbooks(const std::vector<type_t> &types, TextureArray * particle_textures);
+		~ExplosionFlipbooks();
+
+		void spawn(int type, const glm::vec3 &position);
+
+		/*
+		 * Advance all explosions and remove the finished ones
+		 */
+		void update(float dt);
+
+		/*
+		 * Draw all explosions, the particle depth texture must be bound like for ParticleWorld::render
+		 */
+		void render();
+
+		//Use flipbooks instead of simulating the explosions, set from graphics.cfg. Off by default:
+		//the flipbooks are cheaper but skip the explosion LOD and the impacts spawned by the backend
+		static bool enabled;
+
+		//Frames per type and their size in pixels
+		static int num_frames;
+		static int resolution;
+
+	private:
+		struct flipbook_t {
+			float duration; //Seconds, the frames are spread evenly over it
+			float radius; //Half size of the billboard
+			bool rotate; //No gravity or wind, so any rotation of the billboard looks right
+		};
+
+		/*
+		 * Simulate t and render its frames to the layers from first_layer
+		 */
+		flipbook_t bake(const type_t &t, int first_layer, TextureArray * particle_textures, GLuint fbo, GLuint vbo);
+
+		struct explosion_t {
+			glm::vec3 position;
+			float age;
+			int type;
+			float rotation;
+		};
+
+		//Must be same as in flipbook.vert
+		struct vertex_t {
+			glm::vec4 position; //w is half size
+			float frame; //Layer, the fraction blends to the next
+			float rotation;
+		};
+
+		Shader * shader_;
+		GLuint texture_;
+		GLuint vbo_;
+
+		std::vector<flipbook_t> flipbooks_;
+		std::vector<explosion_t> explosions_;
+		std::vector<vertex_t> vertices_;
+};
+
+#endif
@@ -2,25 +2,33 @@ class Camera;
 class CL;
 class Color;
 class Data;
+class Dust;
 class Enemy;
 class EnemyAI;
 class EnemyTemplate;
+class ExplosionFlipbooks;
 struct Light;
 class Material;
 class Mesh;
 class MovableObject;
 class ParticleSystem;
+class ParticleWorld;
+class HealthBars;
 class HittingParticles;
 class Highscore;
+class InstancedModels;
 class Game;
+class GLState;
 class Path;
 class PointTable;
 class Quad;
 class Rails;
 class RenderObject;
+class RenderQueue;
 class RenderTarget;
 class Shader;
 class Skybox;
+class Terrain;
 class TextureBase;
 class Texture2D;
 class Texture3D;
@@ -8,6 +8,7 @@
 #include <glm/gtx/rotate_vector.hpp>
 
 #include <vector>
+#include <cmath>
 #include <SDL/SDL.h>
 #include "globals.hpp"
 #include "camera.hpp"
@@ -23,8 +24,13 @@
 #include "sound.hpp"
 #include "particle_system.hpp"
 #include "hitting_particles.hpp"
+#include "particle_world.hpp"
+#include "dust.hpp"
+#include "explosion_flipbooks.hpp"
 #include "enemy_template.hpp"
 #include "enemy.hpp"
+#include "instanced_models.hpp"
+#include "health_bars.hpp"
 #include "highscore.hpp"
 
 #include "path.hpp"
@@ -60,6 +66,29 @@ static void read_particle_config(const ConfigEntry * config, ParticleSystem::con
 	particle_config.gravity_influence_var = config->find("gravity_influence_var", true)->as_float();
 	particle_config.start_texture = config->find("start_texture", true)->as_int();
 	particle_config.num_textures = config->find("num_textures", true)->as_int();
+
+	//Optional, without it the particles fly through the terrain
+	const ConfigEntry * ground = config->find("ground");
+	if(ground != nullptr) {
+		const std::string &response = ground->as_string();
+		if(response == "none") {
+			particle_config.ground.x = ParticleSystem::GROUND_NONE;
+		} else if(response == "kill") {
+			particle_config.ground.x = ParticleSystem::GROUND_KILL;
+		} else if(response == "bounce") {
+			particle_config.ground.x = ParticleSystem::GROUND_BOUNCE;
+		} else if(response == "stick") {
+			particle_config.ground.x = ParticleSystem::GROUND_STICK;
+		} else {
+			fprintf(stderr, "Unknown ground response %s, must be none, kill, bounce or stick\n", response.c_str());
+			util_abort();
+		}
+		const ConfigEntry * restitution = config->find("ground_restitution");
+		particle_config.ground.y = restitution != nullptr ? restitution->as_float() : 0.5f;
+	}
+
+	const ConfigEntry * turbulence = config->find("turbulence");
+	if(turbulence != nullptr) particle_config.turbulence.x = turbulence->as_float();
 }
 
 bool Game::start_pressed() const {
@@ -178,6 +207,11 @@ Game::Game(const std::string &level, float near, float far, float fov) :
 
 	particle_shader = Shader::create_shader("particles");
 	passthru = Shader::create_shader("passthru");
+	enemy_shader = Shader::create_shader("normal_instanced");
+	enemy_geometry_shader = Shader::create_shader("passthru_instanced");
+	enemy_models = new InstancedModels();
+	health_bars = new HealthBars();
+	init_render_queue();
 
 	static const Config particle_config = Config::parse(base_dir + "/particles.cfg");
 
@@ -193,10 +227,12 @@ Game::Game(const std::string &level, float near, float far, float fov) :
 
 	static const int max_attack_particles = particle_config["/particles/max_attack_particles"]->as_int();
 	static const int max_smoke_particles = particle_config["/particles/max_smoke_particles"]->as_int();
-	static const int max_dust_particles = particle_config["/particles/max_dust_particles"]->as_int();
 	static const int max_explosion_particles = particle_config["/particles/max_explosion_particles"]->as_int();
 
-	attack_particles = new HittingParticles(max_attack_particles, particle_textures, EnemyTemplate::max_num_enemies, false);
+	particle_world = new ParticleWorld(particle_textures, EnemyTemplate::max_num_enemies);
+	particle_world->set_terrain(terrain);
+
+	attack_particles = new HittingParticles(particle_world, max_attack_particles, EnemyTemplate::max_num_enemies, false);
 	attack_particles->config.gravity = gravity;
 	system_configs.push_back(&(attack_particles->config));
 	attack_particles->config.spawn_area = glm::vec4(0.f, 0.f, 0.f, canon_inner_radius);
@@ -222,7 +258,7 @@ Game::Game(const std::string &level, float near, float far, float fov) :
 	particle_types[HEAVY_PARTICLES].damage = particle_config["/particles/heavy/damage"]->as_float();
 
 	//Smoke:
-	smoke = new ParticleSystem(max_smoke_particles, particle_textures, false);
+	smoke = new ParticleSystem(particle_world, max_smoke_particles, false);
 	smoke->config.gravity = gravity;
 	system_configs.push_back(&(smoke->config));
 	smoke->config.spawn_area = glm::vec4(0.f, 0.f, 0.f, canon_inner_radius * 2.0);
@@ -231,38 +267,37 @@ Game::Game(const std::string &level, float near, float far, float fov) :
 	smoke_count = particle_config["/particles/smoke/count"]->as_int();
 	smoke_spawn_speed = particle_config["/particles/smoke/spawn_speed"]->as_float();
 
-	//Dust:
-	dust = new ParticleSystem(max_dust_particles, particle_textures, true);
+	//Dust, drawn without simulation:
+	dust = new Dust(particle_config["/particles/dust"], particle_textures);
 
-	read_particle_config(particle_config["/particles/dust"], dust->config);
-
-	dust->config.gravity = gravity;
-	system_configs.push_back(&(dust->config));
-	dust->config.spawn_area = particle_config["/particles/dust/spawn_area"]->as_vec4();
-	dust->config.avg_spawn_velocity = glm::vec4(particle_config["/particles/dust/avg_spawn_velocity"]->as_vec3(), 0);
-	dust->avg_spawn_rate = particle_config["/particles/dust/avg_spawn_rate"]->as_float();
-	dust->spawn_rate_var = particle_config["/particles/dust/spawn_rate_var"]->as_float();
-	dust_spawn_ahead = particle_config["/particles/dust/spawn_ahead"]->as_float();
-	half_dust_spawn_area = glm::vec3(dust->config.spawn_area.x, dust->config.spawn_area.y, dust->config.spawn_area.z) / 2.f;
-
-	dust->config.spawn_position = glm::vec4(player.position() - half_dust_spawn_area, 1.f);
-	dust->update_config();
-	dust->spawn(dust->avg_spawn_rate * 5.0);
-	dust->config.spawn_position += glm::vec4(path->at(player.path_position() + dust_spawn_ahead / 2.f), 0.f);
-	dust->spawn(dust->avg_spawn_rate * 5.0);
-
-	//Explosions
-	explosions = new ParticleSystem(max_explosion_particles, particle_textures, false);
-
-	hit_explosion = explosions->config;
+	//Explosions, simulated or pre-baked to flipbooks
+	if(ExplosionFlipbooks::enabled) {
+		explosions = nullptr;
+		hit_explosion = ParticleSystem::config_t();
+		kill_explosion = ParticleSystem::config_t();
+	} else {
+		explosions = new ParticleSystem(particle_world, max_explosion_particles, false);
+		hit_explosion = explosions->config;
+		kill_explosion = explosions->config;
+	}
 	system_configs.push_back(&(hit_explosion));
-	kill_explosion = explosions->config;
 	system_configs.push_back(&(kill_explosion));
 	read_particle_config(particle_config["/particles/hit_explosion"], hit_explosion);
 	read_particle_config(particle_config["/particles/kill_explosion"], kill_explosion);
+	hit_explosion.gravity = gravity;
+	kill_explosion.gravity = gravity;
 
-	explosions->config.gravity = gravity;
-	system_configs.push_back(&(explosions->config));
+	if(explosions != nullptr) {
+		explosions->config.gravity = gravity;
+		system_configs.push_back(&(explosions->config));
+
+		//Far explosions are run less often, and past the point where the fog (see fog.glsl) is saturated to 1/255 their color and scale are not interpolated
+		explosions->config.lod_distances = glm::vec4(particle_config["/particles/explosion_lod_distances"]->as_vec2(), sqrtf(logf(255.f)) / fog_intensity, 0.f);
+
+		//enemy_impact() replaces the config with these
+		hit_explosion.lod_distances = explosions->config.lod_distances;
+		kill_explosion.lod_distances = explosions->config.lod_distances;
+	}
 	hit_explosion_count = particle_config["/particles/hit_explosion/count"]->as_int();
 	kill_explosion_count = particle_config["/particles/kill_explosion/count"]->as_int();
 	kill_explosion.spawn_area = particle_config["/particles/kill_explosion/spawn_area"]->as_vec4();
@@ -270,7 +305,25 @@ Game::Game(const std::string &level, float near, float far, float fov) :
 	hit_explosion.spawn_area = particle_config["/particles/hit_explosion/spawn_area"]->as_vec4();
 	hit_explosion.avg_spawn_velocity = glm::vec4(particle_config["/particles/hit_explosion/avg_spawn_velocity"]->as_vec3(), 0);
 
+	if(explosions != nullptr) {
+		//The explosions are run with the config of the emitter (ground, turbulence and so on),
+		//impacts spawned on the device never replace it, so it starts out as the one of the hits
+		explosions->config = hit_explosion;
+		explosions->update_config();
+	}
+
 	update_wind_velocity();
+
+	//Baked once here, with the wind of now
+	explosion_flipbooks = nullptr;
+	if(explosions == nullptr) {
+		std::vector<ExplosionFlipbooks::type_t> types(2);
+		types[HIT_EXPLOSION].config = hit_explosion;
+		types[HIT_EXPLOSION].count = hit_explosion_count;
+		types[KILL_EXPLOSION].config = kill_explosion;
+		types[KILL_EXPLOSION].count = kill_explosion_count;
+		explosion_flipbooks = new ExplosionFlipbooks(types, particle_textures);
+	}
 	//Setup HUD
 
 
@@ -372,9 +425,13 @@ Game::~Game() {
 
 	delete smoke;
 	delete attack_particles;
-	delete particle_textures;
 	delete explosions;
+	delete explosion_flipbooks;
 	delete dust;
+	delete particle_world;
+	delete particle_textures;
+	delete enemy_models;
+	delete health_bars;
 
 	delete hud_choice_quad;
 	delete fullscreen_quad;
@@ -393,6 +450,9 @@ void Game::update(float dt) {
 			break;
 		case MODE_GAME:
 			{
+				//Must happen before any enemies are deleted
+				attack_particles->apply_hits(this);
+
 				if(life <= 0) {
 
 					// Delete all enemies.
@@ -512,23 +572,19 @@ void Game::update(float dt) {
 
 				update_enemies(dt);
 
-				smoke->update(dt);
-				attack_particles->update(dt, enemies, this);
+				attack_particles->update_targets(enemies);
 
-				dust->config.spawn_position = glm::vec4(path->at(player.path_position() + dust_spawn_ahead) - half_dust_spawn_area, 1.f);
-				dust->update_config();
-				dust->update(dt);
-				
-				explosions->update(dt);
+				dust->update(dt, wind_velocity, glm::vec3(gravity));
+
+				particle_world->set_camera(camera.position());
+
+				//All particle systems in one go
+				particle_world->update(dt);
+
+				if(explosion_flipbooks != nullptr) explosion_flipbooks->update(dt);
 
 				life_text.set_number(life);
 				score_text.set_number(score);
-
-			dust->config.spawn_position = glm::vec4(path->at(player.path_position() + dust_spawn_ahead) - half_dust_spawn_area, 1.f);
-			dust->update_config();
-			dust->update(dt);
-			
-			explosions->update(dt);
 			
 			active_sounds.remove_if([](const Sound * s) {
 				if(s->is_done()) {
@@ -638,22 +694,40 @@ void Game::handle_input(const SDL_Event &event) {
 	input.parse_event(event);
 }
 
-void Game::render_geometry() {
-
-	terrain->render_geometry();
+void Game::init_render_queue() {
+	render_queue.add(RenderQueue::PASS_GEOMETRY, nullptr, nullptr, terrain, [this]() { terrain->render_geometry(); });
+	render_queue.add(RenderQueue::PASS_GEOMETRY, nullptr, nullptr, rails, [this]() { rails->render_geometry(); });
+	render_queue.add(RenderQueue::PASS_GEOMETRY, nullptr, nullptr, &player, [this]() { player.render_geometry(); });
+	render_queue.add(RenderQueue::PASS_GEOMETRY, enemy_geometry_shader, nullptr, enemy_models, [this]() { enemy_models->render(); });
 
-	rails->render_geometry();
+	render_queue.add(RenderQueue::PASS_COLOR, terrain->shader(), &terrain->material, terrain, [this]() { terrain->render(); });
+	render_queue.add(RenderQueue::PASS_COLOR, rails->shader(), &rail_material, rails, [this]() {
+		rail_material.bind();
+		rails->render();
+	});
+	render_queue.add(RenderQueue::PASS_COLOR, player.shader(), nullptr, &player, [this]() { player.render(); });
+	render_queue.add(RenderQueue::PASS_COLOR, enemy_shader, nullptr, enemy_models, [this]() { enemy_models->render(); });
+}
 
-	player.render_geometry();
+void Game::render_geometry() {
+	render_queue.render(RenderQueue::PASS_GEOMETRY);
+}
 
+void Game::gather_enemies() {
+	enemy_models->clear();
+	health_bars->clear();
 	for(const Enemy * e : enemies) {
-		e->render_geometry();
+		enemy_models->add(e->render_object(), e->matrix());
+		health_bars->add(e->health_bar());
 	}
+	enemy_models->upload();
 }
 
 void Game::render() {
 
 	if(current_mode == MODE_GAME) {
+		gather_enemies();
+
 		lights.lights[0]->render_shadow_map(camera, [&]() -> void  {
 			render_geometry();
 		});
@@ -674,26 +748,15 @@ void Game::render() {
 		Shader::upload_camera(camera);
 		Shader::upload_lights(lights);
 
-		terrain->render();
-
-		rail_material.bind();
-		rails->render();
-
-		player.render();
-
-		passthru->bind();
-		for(Enemy * e : enemies) {
-			e->render();
-		}
+		render_queue.render(RenderQueue::PASS_COLOR);
+		health_bars->render();
 
 		particle_shader->bind();
 		geometry->depth_bind(Shader::TEXTURE_2D_0);
 
-		attack_particles->render();
-		
-		smoke->render();
-		explosions->render();
+		particle_world->render();
 		dust->render();
+		if(explosion_flipbooks != nullptr) explosion_flipbooks->render();
 
 		composition->unbind();
 
@@ -773,6 +836,15 @@ void Game::update_wind_velocity() {
 	for(ParticleSystem::config_t * c : system_configs) {
 		c->wind_velocity = v4;
 	}
+	attack_particles->update_config();
+	smoke->update_config();
+	if(explosions != nullptr) explosions->update_config();
+	particle_world->set_wind(wind_velocity);
+
+	//Hits spawn their explosions on the device, with a copy of the config
+	if(explosions != nullptr) {
+		attack_particles->set_impacts(explosions, hit_explosion, hit_explosion_count);
+	}
 }
 
 const Player &Game::get_player() const {
@@ -789,9 +861,15 @@ void Game::change_particles(int delta) {
 		current_particle_type = (particle_type_t)new_type;
 	//current_particle_type = new_type;
 	attack_particles->config = particle_types[current_particle_type].config;
+	attack_particles->update_config();
 }
 
 void Game::enemy_impact(const glm::vec3 &position, bool kill) {
+	if(explosion_flipbooks != nullptr) {
+		explosion_flipbooks->spawn(kill ? KILL_EXPLOSION : HIT_EXPLOSION, position);
+		return;
+	}
+
 	int count;
 	if(kill) {
 		count = kill_explosion_count;
@@ -12,6 +12,7 @@
 #include "lights_data.hpp"
 #include "particle_system.hpp"
 #include "hitting_particles.hpp"
+#include "particle_world.hpp"
 
 #include "path.hpp"
 
@@ -19,6 +20,7 @@
 
 #include "sound.hpp"
 #include "player.hpp"
+#include "render_queue.hpp"
 #include "text.hpp"
 
 #include <list>
@@ -49,6 +51,11 @@ class Game {
 			HEAVY_PARTICLES
 		};
 
+		enum explosion_type_t {
+			HIT_EXPLOSION = 0,
+			KILL_EXPLOSION
+		};
+
 		struct particle_config_t {
 			ParticleSystem::config_t config;
 			int count;
@@ -77,7 +84,11 @@ class Game {
 		Rails * rails;
 		Player player;
 
-		ParticleSystem *dust, *smoke, *explosions;
+		//Holds and runs all particle systems below
+		ParticleWorld * particle_world;
+		ParticleSystem *smoke, *explosions; //explosions is nullptr when they are drawn from flipbooks
+		Dust * dust;
+		ExplosionFlipbooks * explosion_flipbooks;
 		ParticleSystem::config_t hit_explosion, kill_explosion;
 		HittingParticles * attack_particles;
 		particle_config_t particle_types[3];
@@ -85,8 +96,6 @@ class Game {
 		int smoke_count;
 		int hit_explosion_count, kill_explosion_count;
 		float smoke_spawn_speed;
-		float dust_spawn_ahead;
-		glm::vec3 half_dust_spawn_area;
 		std::list<ParticleSystem::config_t*> system_configs;
 
 		TextureArray * particle_textures;
@@ -106,6 +115,16 @@ class Game {
 
 		Shader *particle_shader, *passthru;
 
+		//All enemies, gathered once per frame and drawn with one instanced draw per model and pass
+		InstancedModels * enemy_models;
+		HealthBars * health_bars;
+		Shader *enemy_shader, *enemy_geometry_shader;
+		void gather_enemies();
+
+		//The opaque draws of the level, added once
+		RenderQueue render_queue;
+		void init_render_queue();
+
 		glm::vec4 gravity;
 
 		glm::vec3 camera_offset;
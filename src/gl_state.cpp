@@ -0,0 +1,248 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gl_state.hpp"
+#include "utils.hpp"
+
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+enum {
+	MAX_TEXTURE_UNITS = 32,
+	NUM_TEXTURE_TARGETS = 4,
+	NUM_CAPS = 3,
+	MAX_UNIFORM_BINDINGS = 16,
+};
+
+static const GLenum texture_targets[NUM_TEXTURE_TARGETS] = {
+	GL_TEXTURE_2D,
+	GL_TEXTURE_CUBE_MAP,
+	GL_TEXTURE_2D_ARRAY,
+	GL_TEXTURE_3D,
+};
+
+static const GLenum caps[NUM_CAPS] = {
+	GL_BLEND,
+	GL_CULL_FACE,
+	GL_DEPTH_TEST,
+};
+
+//Not a name GL hands out, marks state that isn't known
+static const GLuint unknown = ~0u;
+
+//The part of the shadow glPushAttrib saves
+struct attrib_state_t {
+	attrib_state_t() : depth_mask(-1), blend_known(false) {
+		for(int i=0; i < NUM_CAPS; ++i) caps[i] = -1;
+		for(int i=0; i < 4; ++i) blend[i] = GL_ZERO;
+	}
+
+	int caps[NUM_CAPS]; //-1 when not known
+	int depth_mask;
+	bool blend_known;
+	GLenum blend[4]; //src and dst rgb, src and dst alpha
+};
+
+struct uniform_range_t {
+	GLuint buffer;
+	GLintptr offset;
+	GLsizeiptr size;
+};
+
+struct gl_state_t {
+	gl_state_t() : program(unknown), vertex_array(unknown), active_unit(unknown) {
+		for(int u=0; u < MAX_TEXTURE_UNITS; ++u) {
+			for(int t=0; t < NUM_TEXTURE_TARGETS; ++t) textures[u][t] = unknown;
+		}
+		for(int i=0; i < MAX_UNIFORM_BINDINGS; ++i) uniform_ranges[i].buffer = unknown;
+	}
+
+	GLuint program;
+	GLuint vertex_array;
+	GLuint active_unit;
+	GLuint textures[MAX_TEXTURE_UNITS][NUM_TEXTURE_TARGETS];
+	uniform_range_t uniform_ranges[MAX_UNIFORM_BINDINGS];
+	attrib_state_t attribs;
+};
+
+static gl_state_t state;
+static std::vector<std::pair<GLbitfield, attrib_state_t> > attrib_stack;
+
+static int texture_target_index(GLenum target) {
+	for(int t=0; t < NUM_TEXTURE_TARGETS; ++t) {
+		if(texture_targets[t] == target) return t;
+	}
+	return -1;
+}
+
+static int cap_index(GLenum cap) {
+	for(int i=0; i < NUM_CAPS; ++i) {
+		if(caps[i] == cap) return i;
+	}
+	return -1;
+}
+
+void GLState::invalidate() {
+	state = gl_state_t();
+}
+
+void GLState::use_program(GLuint program) {
+	if(state.program == program) return;
+	glUseProgram(program);
+	state.program = program;
+}
+
+void GLState::delete_program(GLuint program) {
+	//The name may be handed out again
+	if(state.program == program) state.program = unknown;
+	glDeleteProgram(program);
+}
+
+void GLState::bind_texture(GLenum unit, GLenum target, GLuint texture) {
+	const GLuint u = unit - GL_TEXTURE0;
+	const int t = texture_target_index(target);
+	if(u >= MAX_TEXTURE_UNITS || t < 0) {
+		fprintf(stderr, "[GLState] Texture unit %u or target 0x%x is not shadowed\n", u, target);
+		util_abort();
+	}
+
+	//Callers may go on with glTexParameter and the like, so the unit is made active either way
+	if(state.active_unit != unit) {
+		glActiveTexture(unit);
+		state.active_unit = unit;
+	}
+
+	if(state.textures[u][t] == texture) return;
+	glBindTexture(target, texture);
+	state.textures[u][t] = texture;
+}
+
+void GLState::bind_texture(GLenum target, GLuint texture) {
+	if(state.active_unit == unknown) {
+		glActiveTexture(GL_TEXTURE0);
+		state.active_unit = GL_TEXTURE0;
+	}
+	bind_texture(state.active_unit, target, texture);
+}
+
+void GLState::delete_textures(GLsizei n, const GLuint * textures) {
+	//GL unbinds them from all units
+	for(GLsizei i=0; i < n; ++i) {
+		for(int u=0; u < MAX_TEXTURE_UNITS; ++u) {
+			for(int t=0; t < NUM_TEXTURE_TARGETS; ++t) {
+				if(state.textures[u][t] == textures[i]) state.textures[u][t] = 0;
+			}
+		}
+	}
+	glDeleteTextures(n, textures);
+}
+
+void GLState::bind_vertex_array(GLuint vao) {
+	if(state.vertex_array == vao) return;
+	glBindVertexArray(vao);
+	state.vertex_array = vao;
+}
+
+void GLState::delete_vertex_arrays(GLsizei n, const GLuint * vaos) {
+	//Deleting the bound one reverts to the default
+	for(GLsizei i=0; i < n; ++i) {
+		if(state.vertex_array == vaos[i]) state.vertex_array = 0;
+	}
+	glDeleteVertexArrays(n, vaos);
+}
+
+void GLState::bind_uniform_range(GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+	if(index >= MAX_UNIFORM_BINDINGS) {
+		glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, size);
+		return;
+	}
+
+	uniform_range_t &r = state.uniform_ranges[index];
+	if(r.buffer == buffer && r.offset == offset && r.size == size) return;
+
+	glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, size);
+	r.buffer = buffer;
+	r.offset = offset;
+	r.size = size;
+}
+
+static void set_cap(GLenum cap, bool enabled) {
+	const int i = cap_index(cap);
+	if(i >= 0 && state.attribs.caps[i] == (int) enabled) return;
+
+	if(enabled) {
+		glEnable(cap);
+	} else {
+		glDisable(cap);
+	}
+	if(i >= 0) state.attribs.caps[i] = enabled;
+}
+
+void GLState::enable(GLenum cap) {
+	set_cap(cap, true);
+}
+
+void GLState::disable(GLenum cap) {
+	set_cap(cap, false);
+}
+
+void GLState::depth_mask(GLboolean flag) {
+	if(state.attribs.depth_mask == (int) flag) return;
+	glDepthMask(flag);
+	state.attribs.depth_mask = flag;
+}
+
+void GLState::blend_func(GLenum src, GLenum dst) {
+	blend_func_separate(src, dst, src, dst);
+}
+
+void GLState::blend_func_separate(GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha) {
+	attrib_state_t &a = state.attribs;
+	if(a.blend_known && a.blend[0] == src_rgb && a.blend[1] == dst_rgb && a.blend[2] == src_alpha && a.blend[3] == dst_alpha) return;
+
+	if(src_rgb == src_alpha && dst_rgb == dst_alpha) {
+		glBlendFunc(src_rgb, dst_rgb);
+	} else {
+		glBlendFuncSeparate(src_rgb, dst_rgb, src_alpha, dst_alpha);
+	}
+	a.blend_known = true;
+	a.blend[0] = src_rgb;
+	a.blend[1] = dst_rgb;
+	a.blend[2] = src_alpha;
+	a.blend[3] = dst_alpha;
+}
+
+void GLState::push_attrib(GLbitfield mask) {
+	glPushAttrib(mask);
+	attrib_stack.push_back(std::make_pair(mask, state.attribs));
+}
+
+void GLState::pop_attrib() {
+	if(attrib_stack.empty()) {
+		fprintf(stderr, "[GLState] pop_attrib without push_attrib\n");
+		util_abort();
+	}
+
+	glPopAttrib();
+
+	const GLbitfield mask = attrib_stack.back().first;
+	const attrib_state_t &saved = attrib_stack.back().second;
+	attrib_state_t &a = state.attribs;
+
+	if(mask & GL_ENABLE_BIT) {
+		for(int i=0; i < NUM_CAPS; ++i) a.caps[i] = saved.caps[i];
+	}
+	if(mask & GL_DEPTH_BUFFER_BIT) {
+		a.depth_mask = saved.depth_mask;
+		a.caps[cap_index(GL_DEPTH_TEST)] = saved.caps[cap_index(GL_DEPTH_TEST)];
+	}
+	if(mask & GL_COLOR_BUFFER_BIT) {
+		a.blend_known = saved.blend_known;
+		for(int i=0; i < 4; ++i) a.blend[i] = saved.blend[i];
+		a.caps[cap_index(GL_BLEND)] = saved.caps[cap_index(GL_BLEND)];
+	}
+
+	attrib_stack.pop_back();
+}
@@ -0,0 +1,53 @@
+#ifndef GL_STATE_HPP
+#define GL_STATE_HPP
+
+#include <GL/glew.h>
+
+/*
+ * Shadow of the GL state that changes often between draws, so changes to what is already set never reach the driver.
+ * The shadowed state must only be changed through here or the shadow goes stale, glPushAttrib/glPopAttrib included.
+ * Vertex and index buffer bindings are not shadowed, they belong to the vertex array objects.
+ */
+class GLState {
+	public:
+		/*
+		 * Forget all of the shadow, the next change of each state is sent
+		 */
+		static void invalidate();
+
+		static void use_program(GLuint program);
+		static void delete_program(GLuint program);
+
+		/*
+		 * unit is GL_TEXTURE0 + n, like Shader::TextureUnit. Without unit the active one is used
+		 */
+		static void bind_texture(GLenum unit, GLenum target, GLuint texture);
+		static void bind_texture(GLenum target, GLuint texture);
+		static void delete_textures(GLsizei n, const GLuint * textures);
+
+		/*
+		 * Code without a vertex array object of its own uses 0, the default one
+		 */
+		static void bind_vertex_array(GLuint vao);
+		static void delete_vertex_arrays(GLsizei n, const GLuint * vaos);
+
+		static void bind_uniform_range(GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+		/*
+		 * GL_BLEND, GL_CULL_FACE and GL_DEPTH_TEST are shadowed, other caps are passed through
+		 */
+		static void enable(GLenum cap);
+		static void disable(GLenum cap);
+
+		static void depth_mask(GLboolean flag);
+		static void blend_func(GLenum src, GLenum dst);
+		static void blend_func_separate(GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha);
+
+		/*
+		 * glPushAttrib/glPopAttrib, pop also restores the shadow of GL_ENABLE_BIT, GL_DEPTH_BUFFER_BIT and GL_COLOR_BUFFER_BIT
+		 */
+		static void push_attrib(GLbitfield mask);
+		static void pop_attrib();
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "health_bars.hpp"
+#include "gl_state.hpp"
+#include "shader.hpp"
+#include "utils.hpp"
+
+#include <cstddef>
+
+HealthBars::HealthBars() {
+	shader_ = Shader::create_shader("health");
+	glGenBuffers(1, &vbo_);
+
+	glGenVertexArrays(1, &vao_);
+	GLState::bind_vertex_array(vao_);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+	for(int i=0; i < 3; ++i) {
+		glEnableVertexAttribArray(i);
+	}
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(bar_t), (GLvoid*) offsetof(bar_t, position));
+	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(bar_t), (GLvoid*) offsetof(bar_t, life));
+	glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(bar_t), (GLvoid*) offsetof(bar_t, scale));
+	GLState::bind_vertex_array(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+HealthBars::~HealthBars() {
+	GLState::delete_vertex_arrays(1, &vao_);
+	glDeleteBuffers(1, &vbo_);
+}
+
+void HealthBars::clear() {
+	bars_.clear();
+}
+
+void HealthBars::add(const bar_t &bar) {
+	bars_.push_back(bar);
+}
+
+void HealthBars::render() {
+	if(bars_.empty()) return;
+
+	shader_->bind();
+
+	//Respecified every frame, so the driver can hand out new storage instead of waiting for the last draw
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(bar_t) * bars_.size(), &bars_[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	GLState::bind_vertex_array(vao_);
+	glDrawArrays(GL_POINTS, 0, (GLsizei) bars_.size());
+	GLState::bind_vertex_array(0);
+
+	checkForGLErrors("[HealthBars] Render");
+}
@@ -0,0 +1,38 @@
+#ifndef HEALTH_BARS_HPP
+#define HEALTH_BARS_HPP
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+
+/*
+ * The health bars of all enemies, streamed to one vertex buffer and drawn as one batch of points
+ * that shaders/health.geom expands to bars.
+ */
+class HealthBars {
+	public:
+		struct bar_t {
+			glm::vec3 position; //Center of the bar, in world space
+			float life; //0..1, sets the color
+			float scale; //Width
+		};
+
+		HealthBars();
+		~HealthBars();
+
+		/*
+		 * Forget the bars of the last frame
+		 */
+		void clear();
+
+		void add(const bar_t &bar);
+
+		void render();
+
+	private:
+		Shader * shader_;
+		std::vector<bar_t> bars_;
+		GLuint vbo_, vao_;
+};
+
+#endif
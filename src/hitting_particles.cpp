@@ -5,75 +5,112 @@
 #include "hitting_particles.hpp"
 #include "globals.hpp"
 
-HittingParticles::HittingParticles(const int max_num_particles, TextureArray* texture, int max_num_enemies, bool _auto_spawn, const std::string &kernel) : ParticleSystem(max_num_particles, texture, _auto_spawn, kernel),
+#include <algorithm>
+#include <cmath>
+
+HittingParticles::HittingParticles(ParticleWorld * world, const int max_num_particles, int max_num_enemies, bool _auto_spawn) : ParticleSystem(world, max_num_particles, _auto_spawn, true),
 	max_num_enemies_(max_num_enemies)
+	, impact_emitter_(0)
+	, impact_count_(0)
+	, num_buckets_(ParticleBackend::grid_buckets(max_num_enemies))
+	, cell_size_(1.f)
+	, max_particle_radius_(0.f)
 {
+	grid_cells_host_.resize(2 * num_buckets_);
+	grid_enemies_host_.resize(std::max(max_num_enemies, 1));
+	grid_fill_.resize(num_buckets_);
+}
+
+HittingParticles::~HittingParticles() { }
 
-	enemy_data_t * initial_enemies = new enemy_data_t[max_num_enemies];
+//Largest radius a particle of config c can grow to, same as in run_particles
+static float max_radius(const ParticleSystem::config_t &c) {
+	const float max_scale = c.avg_scale + c.scale_var + std::max(c.avg_scale_change + c.scale_change_var, 0.f);
+	return max_scale * 0.5f * 0.1f;
+}
 
-	enemies_ = opencl->create_buffer(CL_MEM_READ_ONLY, sizeof(enemy_data_t) * max_num_enemies);
-	cl_int err = opencl->queue().enqueueWriteBuffer(enemies_, CL_TRUE, 0, sizeof(enemy_data_t) * max_num_enemies, initial_enemies, NULL,NULL);
+void HittingParticles::build_grid() {
+	float max_enemy_radius = 0.f;
+	for(const enemy_data_t &e : enemy_list_) {
+		max_enemy_radius = std::max(max_enemy_radius, e.radius);
+	}
+
+	//Anything closer than this to a particle must be in one of its 27 neighbouring cells
+	cell_size_ = std::max(max_enemy_radius + max_particle_radius_, 0.01f);
+
+	std::fill(grid_cells_host_.begin(), grid_cells_host_.end(), 0);
+	std::fill(grid_fill_.begin(), grid_fill_.end(), 0);
+
+	std::vector<cl_uint> bucket(enemy_list_.size());
+
+	for(unsigned int i=0; i < enemy_list_.size(); ++i) {
+		const glm::vec3 &p = enemy_list_[i].position;
+		const glm::ivec3 cell((int)floorf(p.x / cell_size_), (int)floorf(p.y / cell_size_), (int)floorf(p.z / cell_size_));
+		bucket[i] = ParticleBackend::grid_hash(cell, num_buckets_);
+		++grid_cells_host_[2 * bucket[i] + 1];
+	}
 
-	err = run_kernel_.setArg(6, enemies_);
-	CL::check_error(err, "[ParticleSystem] create hitting particles: Set arg 6");
+	//Prefix sum of counts gives the start of each bucket
+	cl_int start = 0;
+	for(cl_uint b=0; b < num_buckets_; ++b) {
+		grid_cells_host_[2 * b] = start;
+		start += grid_cells_host_[2 * b + 1];
+	}
 
-	delete[] initial_enemies;
+	for(unsigned int i=0; i < enemy_list_.size(); ++i) {
+		const cl_uint b = bucket[i];
+		grid_enemies_host_[grid_cells_host_[2 * b] + grid_fill_[b]++] = i;
+	}
 }
 
-HittingParticles::~HittingParticles() { }
+void HittingParticles::update_targets(std::list<Enemy*> &enemies) {
+	ParticleBackend * backend = world_->backend();
 
-void HittingParticles::update(float dt, std::list<Enemy*> &enemies, Game * game) {
-	cl_int err;
+	//The backend may still read the enemy and grid data of the last update
+	backend->wait();
 
 	enemy_list_.clear();
 	enemy_back_ref_.clear();
 
 	for(Enemy * e : enemies) {
+		if(enemy_list_.size() == (size_t)max_num_enemies_) break;
 		enemy_data_t d = { e->position(), e->radius };
 		enemy_list_.push_back(d);
 		enemy_back_ref_.push_back(e);
 	}
-	
-	std::vector<bool> hit(enemy_list_.size(), false);
 
-	if(enemy_list_.size() > 0) {
-		err = opencl->queue().enqueueWriteBuffer(enemies_, CL_TRUE, 0, sizeof(enemy_data_t) * enemy_list_.size(), &(enemy_list_[0]), NULL,NULL);
-		CL::check_error(err, "[ParticleSystem] write enemies");
+	//Keep track of the largest particle that can be alive, it decides the grid cell size
+	for(const spawn_data &sd : spawn_list_) {
+		max_particle_radius_ = std::max(max_particle_radius_, max_radius(sd.first));
+	}
+	if(auto_spawn) {
+		max_particle_radius_ = std::max(max_particle_radius_, max_radius(config));
 	}
-	err = run_kernel_.setArg(7, (unsigned int) enemies.size());
-	CL::check_error(err, "[ParticleSystem] update hitting: set arg 7");
-
-	ParticleSystem::update(dt);
-
-	//vertex_t * vertices = (vertex_t* ) opencl->queue().enqueueMapBuffer(cl_gl_buffers_[0], CL_TRUE, CL_MAP_READ, 0, sizeof(vertex_t)*max_num_particles_, NULL, NULL, &err);
-	//CL::check_error(err, "[ParticleSystem] map vertices buffer");
-	particle_t * particles = (particle_t* ) opencl->queue().enqueueMapBuffer(particles_, CL_TRUE, CL_MAP_READ, 0, sizeof(particle_t)*max_num_particles_, NULL, NULL, &err);
 
-	CL::check_error(err, "[ParticleSystem] map particles buffer");
+	if(enemy_list_.size() > 0) build_grid();
 
-	opencl->queue().flush();
-	opencl->queue().finish();
+	ParticleBackend::hit_targets_t targets = {
+		enemy_list_.empty() ? nullptr : &enemy_list_[0], (cl_uint) enemy_list_.size(),
+		&grid_cells_host_[0], &grid_enemies_host_[0], cell_size_,
+		impact_emitter_, impact_count_ > 0 ? &impact_config_ : nullptr, (cl_uint) impact_count_ };
+	backend->set_hit_targets(targets);
+}
 
-	for(int i=0; i < max_num_particles_; ++i ) {
-		if(particles[i].extra1 != -1) {
-			Enemy * e = enemy_back_ref_[particles[i].extra1];
-			e->hp -= particles[i].extra3;
-			hit[particles[i].extra1] = true;
-		}
-	}
+void HittingParticles::apply_hits(Game * game) {
+	const ParticleBackend::enemy_hit_t * hits = world_->backend()->read_hits();
+	if(hits == nullptr) return;
 
 	for(unsigned int i=0;i<enemy_back_ref_.size(); ++i) {
-		if(hit[i]) {
-			game->enemy_impact(enemy_back_ref_[i]->position());
+		if(hits[i].count > 0) {
+			enemy_back_ref_[i]->hp -= hits[i].damage;
+			//Otherwise already spawned by the backend
+			if(impact_count_ == 0) game->enemy_impact(enemy_back_ref_[i]->position());
 		}
 	}
+}
 
-	
-	opencl->queue().enqueueUnmapMemObject(particles_, particles, NULL, NULL);
-	CL::check_error(err, "[ParticleSystem] unmap particles buffer");
-	//opencl->queue().enqueueUnmapMemObject(cl_gl_buffers_[0], vertices, NULL, NULL);
-	//CL::check_error(err, "[ParticleSystem] unmap particles buffer");
-
-	opencl->queue().flush();
-	opencl->queue().finish();
+void HittingParticles::set_impacts(const ParticleSystem * emitter, const config_t &config, int count) {
+	impact_emitter_ = emitter->emitter();
+	impact_config_ = config;
+	impact_count_ = count;
 }
@@ -2,26 +2,61 @@
 #define HITTING_PARTICLES_HPP
 
 #include "particle_system.hpp"
+#include "particle_backend.hpp"
+#include "particle_world.hpp"
 #include "enemy.hpp"
 #include "game.hpp"
 
 class HittingParticles : public ParticleSystem {
 	public:
-		HittingParticles(const int max_num_particles, TextureArray* texture, int max_num_enemies, bool _auto_spawn = true, const std::string &kernel = "hitting_particles.cl");
+		/*
+		 * The world must have been created with max_num_enemies > 0, at most that many enemies are tested
+		 */
+		HittingParticles(ParticleWorld * world, const int max_num_particles, int max_num_enemies, bool _auto_spawn = true);
 		virtual ~HittingParticles();
 
-		virtual void update(float dt, std::list<Enemy*> &enemies, Game * game);
+		/*
+		 * Enemies to test the particles against in the next update of the world
+		 */
+		void update_targets(std::list<Enemy*> &enemies);
+
+		/*
+		 * Applies the damage of the hits found by the last update to the enemies and spawns the impacts.
+		 * The result is read back asynchronously, so this must be called before any of the enemies
+		 * passed to the last update are deleted.
+		 */
+		void apply_hits(Game * game);
+
+		/*
+		 * Have the backend spawn count particles of emitter with config at each hit enemy, right after the hit test.
+		 * The emitter must be in the same world. apply_hits then only applies the damage, count 0 turns it off.
+		 */
+		void set_impacts(const ParticleSystem * emitter, const config_t &config, int count);
 	private:
-		cl::Buffer enemies_;
 		int max_num_enemies_;
 
-		struct enemy_data_t {
-			__ALIGNED__(glm::vec3 position, 16);
-			__ALIGNED__(float radius, 16);
-		};
+		int impact_emitter_;
+		config_t impact_config_;
+		int impact_count_;
+
+		typedef ParticleBackend::enemy_data_t enemy_data_t;
 
 		std::vector<enemy_data_t> enemy_list_;
 		std::vector<Enemy*> enemy_back_ref_;
+
+		/*
+		 * Broadphase: the enemies are put in a uniform grid, hashed into num_buckets_ buckets.
+		 * grid_cells_host_ holds (start, count) into grid_enemies_host_ for each bucket.
+		 * Particles only test the enemies in their own and the neighbouring cells.
+		 */
+		void build_grid();
+
+		cl_uint num_buckets_;
+		float cell_size_;
+		std::vector<cl_int> grid_cells_host_, grid_enemies_host_, grid_fill_;
+
+		//Upper bound of the radius of all spawned particles
+		float max_particle_radius_;
 };
 
 #endif
@@ -0,0 +1,56 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "instanced_models.hpp"
+#include "render_object.hpp"
+#include "utils.hpp"
+
+InstancedModels::InstancedModels() { }
+
+InstancedModels::~InstancedModels() {
+	for(batch_t &b : batches_) {
+		glDeleteBuffers(1, &b.buffer);
+	}
+}
+
+void InstancedModels::clear() {
+	for(batch_t &b : batches_) {
+		b.matrices.clear();
+	}
+}
+
+void InstancedModels::add(const RenderObject * model, const glm::mat4 &matrix) {
+	for(batch_t &b : batches_) {
+		if(b.model == model) {
+			b.matrices.push_back(matrix);
+			return;
+		}
+	}
+
+	batch_t b;
+	b.model = model;
+	b.matrices.push_back(matrix);
+	glGenBuffers(1, &b.buffer);
+	batches_.push_back(b);
+}
+
+void InstancedModels::upload() {
+	for(const batch_t &b : batches_) {
+		if(b.matrices.empty()) continue;
+
+		//Respecified every frame, so the driver can hand out new storage instead of waiting for the last draws
+		glBindBuffer(GL_ARRAY_BUFFER, b.buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(glm::mat4) * b.matrices.size(), &b.matrices[0], GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	checkForGLErrors("[InstancedModels] Upload");
+}
+
+void InstancedModels::render() const {
+	for(const batch_t &b : batches_) {
+		if(b.matrices.empty()) continue;
+		b.model->render_instanced(b.buffer, (GLsizei) b.matrices.size());
+	}
+}
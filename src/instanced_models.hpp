@@ -0,0 +1,48 @@
+#ifndef INSTANCED_MODELS_HPP
+#define INSTANCED_MODELS_HPP
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+
+/*
+ * Draws many copies of a few RenderObjects, all copies of a model with one instanced draw per mesh.
+ * The transforms are collected with add() each frame and streamed to an instance buffer per model by upload(),
+ * after that render() can be called once per pass. The bound shader must read the transform of the
+ * instance from Shader::ATTR_INSTANCE_MATRIX, like normal_instanced.vert and passthru_instanced.vert.
+ */
+class InstancedModels {
+	public:
+		InstancedModels();
+		~InstancedModels();
+
+		/*
+		 * Forget the instances of the last frame
+		 */
+		void clear();
+
+		/*
+		 * Draw model with matrix in place of its MovableObject transform, like RenderObject::render(matrix)
+		 */
+		void add(const RenderObject * model, const glm::mat4 &matrix);
+
+		/*
+		 * Stream all instances added since clear() to the instance buffer
+		 */
+		void upload();
+
+		void render() const;
+
+	private:
+		struct batch_t {
+			const RenderObject * model;
+			std::vector<glm::mat4> matrices;
+			GLuint buffer; //Always the same for the model, so its vertex arrays keep pointing into it
+		};
+
+		//One per model, there are only a few so they are searched linearly.
+		//Kept over clear() so their vectors and buffers are reused
+		std::vector<batch_t> batches_;
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "mesh.hpp"
+#include "gl_state.hpp"
 #include "shader.hpp"
 #include "utils.hpp"
 
@@ -27,8 +28,10 @@ Mesh::Mesh(const std::vector<vertex_t> &vertices, const std::vector<unsigned int
 }
 
 Mesh::~Mesh() {
-	if(vbos_generated_)
+	if(vbos_generated_) {
+		GLState::delete_vertex_arrays(1, &vao_);
 		glDeleteBuffers(2, buffers_);
+	}
 }
 
 void Mesh::set_vertices(const std::vector<vertex_t> &vertices) {
@@ -160,6 +163,25 @@ void Mesh::generate_vbos() {
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	checkForGLErrors("Mesh::generate_vbos(): fill element array buffer");
 
+	/* Attribs of Shader::vertex_x, but no color */
+	glGenVertexArrays(1, &vao_);
+	GLState::bind_vertex_array(vao_);
+	glBindBuffer(GL_ARRAY_BUFFER, buffers_[0]);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers_[1]);
+
+	for(int i=0; i < 5; ++i) {
+		glEnableVertexAttribArray(i);
+	}
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), 0);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (const GLvoid*) (sizeof(glm::vec3)));
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (const GLvoid*) (sizeof(glm::vec3)+sizeof(glm::vec2)));
+	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (const GLvoid*) (2*sizeof(glm::vec3)+sizeof(glm::vec2)));
+	glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (const GLvoid*) (3*sizeof(glm::vec3)+sizeof(glm::vec2)));
+
+	GLState::bind_vertex_array(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	checkForGLErrors("Mesh::generate_vbos(): vertex array");
+
 	num_faces_ = indices_.size();
 
 	vbos_generated_ = true;
@@ -172,29 +194,11 @@ void Mesh::render(const glm::mat4& m) {
 void Mesh::render_geometry(const glm::mat4& m) {
 	Shader::upload_model_matrix(m * matrix());
 
-	glBindBuffer(GL_ARRAY_BUFFER, buffers_[0]);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers_[1]);
-
-	checkForGLErrors("Mesh::render(): Bind buffers");
-
-	/* Disable most attribs from Shader::vertex_x */
-	Shader::push_vertex_attribs(5);
-
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), 0);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (const GLvoid*) (sizeof(glm::vec3)));
-	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (const GLvoid*) (sizeof(glm::vec3)+sizeof(glm::vec2)));
-	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (const GLvoid*) (2*sizeof(glm::vec3)+sizeof(glm::vec2)));
-	glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (const GLvoid*) (3*sizeof(glm::vec3)+sizeof(glm::vec2)));
-
-	checkForGLErrors("Mesh::render(): Set vertex attribs");
+	GLState::bind_vertex_array(vao_);
 
 	glDrawElements(GL_TRIANGLES, num_faces_, GL_UNSIGNED_INT, 0);
 
 	checkForGLErrors("Mesh::render(): glDrawElements()");
 
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-	Shader::pop_vertex_attribs();
-	checkForGLErrors("Mesh::render(): Teardown ");
+	GLState::bind_vertex_array(0);
 }
@@ -48,6 +48,7 @@ class Mesh : public MovableObject {
 		std::vector<unsigned int> indices_;
 	private:
 		GLenum buffers_[2]; //0:vertex buffer, 1: index buffer
+		GLuint vao_; //Attribute pointers into buffers_
 		bool vbos_generated_, has_normals_, has_tangents_;
 		unsigned long num_faces_;
 		glm::vec3 scale_;
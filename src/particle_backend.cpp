@@ -0,0 +1,255 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "particle_backend.hpp"
+#include "cl_particle_backend.hpp"
+#include "cpu_particle_backend.hpp"
+#include "globals.hpp"
+
+#include <GL/glew.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+cl_uint ParticleBackend::seed = 0;
+
+//Number of backends created, mixed into their seeds
+static cl_uint num_created = 0;
+
+static cl_uint backend_seed() {
+	const cl_uint n = num_created++;
+	if(ParticleBackend::seed == 0) return (cl_uint) rand();
+	return ParticleBackend::seed + n * 0x9E3779B9u;
+}
+
+ParticleBackend * ParticleBackend::create(const std::vector<emitter_t> &emitters, const std::string &kernel, int max_num_enemies) {
+	if(opencl != nullptr)
+		return new CLParticleBackend(emitters, kernel, max_num_enemies);
+	else
+		return new CPUParticleBackend(emitters, max_num_enemies);
+}
+
+cl_uint ParticleBackend::grid_buckets(int max_num_enemies) {
+	//Around two buckets per enemy keeps collisions in the hash rare
+	cl_uint num_buckets = 1;
+	while(num_buckets < 2 * (cl_uint) max_num_enemies) num_buckets <<= 1;
+	return num_buckets;
+}
+
+cl_uint ParticleBackend::grid_hash(const glm::ivec3 &cell, cl_uint num_buckets) {
+	return (((cl_uint)cell.x * 73856093u) ^ ((cl_uint)cell.y * 19349663u) ^ ((cl_uint)cell.z * 83492791u)) & (num_buckets - 1);
+}
+
+//Updates an emitter must use less than a quarter of its range before the range is shrunk
+static const int shrink_frames = 300;
+
+//Waves summed into the turbulence field
+static const int num_turbulence_waves = 12;
+
+const std::vector<glm::vec4> &ParticleBackend::turbulence_field() {
+	static std::vector<glm::vec4> field;
+	if(!field.empty()) return field;
+
+	//The curl of a sum of waves a*sin(k.p + phase) is divergence free. With whole periods over
+	//the field along each axis it also tiles. A fixed seed keeps it the same in every run
+	cl_uint rng = 0x2545F491u;
+	auto next = [&rng]() {
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+		return (rng >> 8) * (1.f / 16777216.f);
+	};
+
+	struct wave_t {
+		glm::vec3 k;
+		glm::vec3 curl; //k x a, larger waves are stronger
+		float phase;
+	};
+	std::vector<wave_t> waves(num_turbulence_waves);
+	for(wave_t &w : waves) {
+		glm::ivec3 periods;
+		do {
+			periods = glm::ivec3((int)(next() * 7.f) - 3, (int)(next() * 7.f) - 3, (int)(next() * 7.f) - 3);
+		} while(periods == glm::ivec3(0));
+		w.k = glm::vec3(periods) * (2.f * (float) M_PI / TURBULENCE_SIZE);
+
+		const float z = next() * 2.f - 1.f;
+		const float t = next() * 2.f * (float) M_PI;
+		const glm::vec3 a(sqrtf(1.f - z*z) * cosf(t), sqrtf(1.f - z*z) * sinf(t), z);
+		w.curl = glm::cross(w.k, a) / glm::dot(w.k, w.k);
+		w.phase = next() * 2.f * (float) M_PI;
+	}
+
+	field.resize(TURBULENCE_SIZE * TURBULENCE_SIZE * TURBULENCE_SIZE);
+	double sum_squares = 0.0;
+	for(int z = 0; z < TURBULENCE_SIZE; ++z) {
+		for(int y = 0; y < TURBULENCE_SIZE; ++y) {
+			for(int x = 0; x < TURBULENCE_SIZE; ++x) {
+				const glm::vec3 p(x, y, z);
+				glm::vec3 v(0.f);
+				for(const wave_t &w : waves) {
+					v += cosf(glm::dot(w.k, p) + w.phase) * w.curl;
+				}
+				field[(z * TURBULENCE_SIZE + y) * TURBULENCE_SIZE + x] = glm::vec4(v, 0.f);
+				sum_squares += glm::dot(v, v);
+			}
+		}
+	}
+
+	const float rms = (float) sqrt(sum_squares / field.size());
+	for(glm::vec4 &v : field) {
+		v /= std::max(rms, 1e-6f);
+	}
+	return field;
+}
+
+void ParticleBackend::set_turbulence_offset(const glm::vec4 &offset) {
+	turbulence_offset_ = offset;
+}
+
+static int reserved_particles(const std::vector<ParticleBackend::emitter_t> &emitters) {
+	int sum = 0;
+	for(const ParticleBackend::emitter_t &e : emitters) sum += e.max_count;
+	return sum;
+}
+
+ParticleBackend::ParticleBackend(const std::vector<emitter_t> &emitters)
+	: emitters_(emitters)
+	, max_num_particles_(reserved_particles(emitters))
+	, num_particles_(emitters.back().first + emitters.back().count)
+	, seed_(backend_seed())
+	, turbulence_offset_(0.f, 0.f, 0.f, 1.f)
+	, palette_next_(0)
+	, palette_dirty_(false)
+	, low_use_frames_(emitters.size(), 0) {
+	//Built here, before the cpu backend's workers read it
+	turbulence_field();
+}
+
+//Rounded up to whole chunks
+static int pool_chunks(int count) {
+	return (count + ParticleBackend::POOL_CHUNK - 1) / ParticleBackend::POOL_CHUNK * ParticleBackend::POOL_CHUNK;
+}
+
+void ParticleBackend::resize_pool(const std::vector<cl_int> &free_counts) {
+	//Particles requested by this frame's batch
+	std::vector<int> demand(emitters_.size(), 0);
+	for(const spawn_request_t &request : spawn_requests_) {
+		demand[request.emitter] += request.count;
+	}
+
+	std::vector<emitter_t> layout = emitters_;
+	bool changed = false;
+	int first = 0;
+	for(size_t e=0; e < layout.size(); ++e) {
+		emitter_t &range = layout[e];
+		const int free = free_counts[e];
+		const int live = range.count - free;
+		int count = range.count;
+
+		if((free == 0 || demand[e] > free) && count < range.max_count) {
+			//Full or about to be, at least double it so a growing emitter only moves a few times
+			count = std::min((int) range.max_count, pool_chunks(std::max(2 * count, live + demand[e])));
+			low_use_frames_[e] = 0;
+		} else if(count > POOL_CHUNK && 4 * live < count) {
+			if(++low_use_frames_[e] >= shrink_frames) {
+				//Leave room for twice what is alive now, and for this frame's spawns
+				count = std::min(count, std::max((int) POOL_CHUNK, pool_chunks(std::max(2 * live, live + demand[e]))));
+				low_use_frames_[e] = 0;
+			}
+		} else {
+			low_use_frames_[e] = 0;
+		}
+
+		changed |= (count != range.count || first != range.first);
+		range.first = first;
+		range.count = count;
+		first += count;
+	}
+	if(!changed) return;
+
+	const std::vector<emitter_t> old_layout = emitters_;
+	emitters_ = layout;
+	num_particles_ = first;
+	fprintf(verbose, "[ParticleSystem] Resized particle pool from %d to %d particles (%d reserved)\n",
+			old_layout.back().first + old_layout.back().count, num_particles_, max_num_particles_);
+
+	apply_layout(old_layout);
+}
+
+void ParticleBackend::begin_update() {
+	wait();
+	spawn_configs_.clear();
+	spawn_requests_.clear();
+}
+
+void ParticleBackend::add_spawn_request(int emitter, const config_t &c, int count) {
+	const int offset = spawn_requests_.empty() ? 0 : spawn_requests_.back().offset + spawn_requests_.back().count;
+
+	//No point in spawning more than there are particles
+	count = std::min(std::min(count, (int) emitters_[emitter].max_count), max_num_particles_ - offset);
+	if(count <= 0) return;
+
+	spawn_request_t request = { (cl_int) spawn_configs_.size(), count, offset, palette_index(c), (cl_uchar) emitter, 0 };
+	spawn_configs_.push_back(c);
+	spawn_requests_.push_back(request);
+}
+
+cl_uchar ParticleBackend::palette_index(const config_t &c) {
+	for(size_t i=0; i < palette_.size(); ++i) {
+		const palette_entry_t &p = palette_[i];
+		if(p.birth_color == c.birth_color && p.death_color == c.death_color && p.damage == c.extra) return (cl_uchar) i;
+	}
+
+	palette_entry_t entry;
+	entry.birth_color = c.birth_color;
+	entry.death_color = c.death_color;
+	entry.damage = c.extra;
+	palette_dirty_ = true;
+
+	if(palette_.size() < MAX_PALETTE_SIZE) {
+		palette_.push_back(entry);
+		return (cl_uchar) (palette_.size() - 1);
+	}
+
+	//Live particles spawned with the replaced entry change colors
+	fprintf(verbose, "[ParticleSystem] Palette full, replacing entry %lu\n", (unsigned long) palette_next_);
+	const size_t i = palette_next_;
+	palette_[i] = entry;
+	palette_next_ = (palette_next_ + 1) % MAX_PALETTE_SIZE;
+	return (cl_uchar) i;
+}
+
+//Round to nearest, the particle values are far from the denormal range so those are flushed to zero
+cl_half ParticleBackend::float_to_half(float f) {
+	union { float f; cl_uint u; } bits;
+	bits.f = f;
+	const cl_uint sign = (bits.u >> 16) & 0x8000u;
+	const int exponent = (int)((bits.u >> 23) & 0xff) - 127 + 15;
+	const cl_uint mantissa = bits.u & 0x7fffffu;
+
+	if(exponent <= 0) return (cl_half) sign;
+	if(exponent >= 31) return (cl_half) (sign | 0x7c00u);
+
+	//A carry out of the mantissa correctly bumps the exponent
+	const cl_uint half = ((cl_uint) exponent << 10) + (mantissa >> 13) + ((mantissa >> 12) & 1u);
+	return (cl_half) (sign | std::min(half, 0x7c00u));
+}
+
+void ParticleBackend::vertex_attrib_pointers() {
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+	glEnableVertexAttribArray(3);
+
+	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(vertex_t), (GLvoid*) offsetof(vertex_t, position));
+	glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(vertex_t), (GLvoid*) offsetof(vertex_t, color));
+	glVertexAttribPointer(2, 1, GL_HALF_FLOAT, GL_FALSE, sizeof(vertex_t), (GLvoid*) offsetof(vertex_t, scale));
+	glVertexAttribIPointer(3, 1, GL_UNSIGNED_SHORT, sizeof(vertex_t), (GLvoid*) offsetof(vertex_t, texture_index));
+}
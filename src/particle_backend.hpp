@@ -0,0 +1,239 @@
+#ifndef PARTICLE_BACKEND_HPP
+#define PARTICLE_BACKEND_HPP
+
+#include "particle_system.hpp"
+
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * Runs the simulation of all emitters (ParticleSystems) of a ParticleWorld and owns the vertex data that is drawn.
+ * The pool is split in one range per emitter, the world collects the spawns of a frame and hands them over as a batch.
+ */
+class ParticleBackend {
+	public:
+		typedef ParticleSystem::config_t config_t;
+		typedef ParticleSystem::vertex_t vertex_t;
+
+		//Must be same as in hitting_particles.cl
+		struct enemy_data_t {
+			__ALIGNED__(glm::vec3 position, 16);
+			__ALIGNED__(float radius, 16);
+		};
+
+		//Colors and damage shared by all particles spawned with them, must be same as in particles_structs.cl
+		__ALIGNED__(struct palette_entry_t {
+			glm::vec4 birth_color;
+			glm::vec4 death_color;
+			cl_float damage;
+		}, 16);
+
+		/*
+		 * The range of the pool owned by an emitter, must be same as in particles_structs.cl.
+		 * Sorted by first, first and count are multiples of four.
+		 * count starts at min(POOL_CHUNK, max_count) and is resized in chunks as needed, see resize_pool
+		 */
+		struct emitter_t {
+			cl_int first;
+			cl_int count;
+			cl_int hit_test; //Test against the hit targets
+			cl_int max_count; //Reserved by the emitter, count never grows past it
+		};
+
+		//Ranges are grown and shrunk in steps of this many particles
+		enum { POOL_CHUNK = 1024 };
+
+		//Damage and number of hits on an enemy during one update
+		struct enemy_hit_t {
+			cl_float damage;
+			cl_int count;
+		};
+
+		/*
+		 * Enemies for the hit test, put in a uniform grid hashed into grid_buckets(max_num_enemies) buckets.
+		 * cells holds (start, count) into grid_enemies for each bucket.
+		 * The data must be left untouched until the next wait()
+		 */
+		struct hit_targets_t {
+			const enemy_data_t * enemies;
+			cl_uint num_enemies;
+			const cl_int * cells;
+			const cl_int * grid_enemies;
+			float cell_size; //At least max enemy radius + max particle radius
+
+			//Spawned by the backend at each hit enemy right after the hit test, without a round trip to the host.
+			//impact_count 0 spawns nothing
+			int impact_emitter;
+			const config_t * impact_config;
+			cl_uint impact_count;
+		};
+
+		/*
+		 * Terrain the particles collide with, see config_t::ground.
+		 * heights is row major with size.x per row, like Terrain::height_at reads it
+		 */
+		struct heightfield_t {
+			const float * heights;
+			glm::ivec2 size;
+			float horizontal_scale;
+		};
+
+		/*
+		 * Number of buckets in the enemy grid, a power of two
+		 */
+		static cl_uint grid_buckets(int max_num_enemies);
+
+		//Must be same as grid_hash in hitting_particles.cl
+		static cl_uint grid_hash(const glm::ivec3 &cell, cl_uint num_buckets);
+
+		//Cells along each side of the turbulence field, must be same as in particles_structs.cl
+		enum { TURBULENCE_SIZE = 32 };
+
+		/*
+		 * Tiling, divergence free velocity field of TURBULENCE_SIZE^3 cells (x fastest) with
+		 * an rms speed of 1. Built on first use, the same for all backends
+		 */
+		static const std::vector<glm::vec4> &turbulence_field();
+
+		/*
+		 * Creates the OpenCL backend if opencl is available, otherwise the cpu backend.
+		 * The pool holds all emitters, their configs must be set with update_config before they spawn.
+		 * kernel is only used by OpenCL, max_num_enemies > 0 enables the hit test.
+		 */
+		static ParticleBackend * create(const std::vector<emitter_t> &emitters, const std::string &kernel, int max_num_enemies);
+
+		virtual ~ParticleBackend() { }
+
+		//Seed of the random streams of all backends, 0 picks one with rand().
+		//Set before creating any backend for repeatable runs
+		static cl_uint seed;
+
+		/*
+		 * Block until the last update is done with the data handed to it
+		 */
+		virtual void wait() = 0;
+
+		/*
+		 * Waits and clears the spawn batch
+		 */
+		void begin_update();
+
+		/*
+		 * Add a request for spawning count particles of emitter with config c to this frames spawn batch
+		 */
+		void add_spawn_request(int emitter, const config_t &c, int count);
+
+		/*
+		 * Spawn the batch and run all particles dt seconds
+		 */
+		virtual void update(float dt) = 0;
+
+		/*
+		 * The config the particles of emitter are run with
+		 */
+		virtual void update_config(int emitter, const config_t &config) = 0;
+
+		/*
+		 * Enemies to test the particles against in the next update
+		 */
+		virtual void set_hit_targets(const hit_targets_t &targets) = 0;
+
+		/*
+		 * The heights must be left untouched as long as the backend lives
+		 */
+		virtual void set_heightfield(const heightfield_t &heightfield) = 0;
+
+		/*
+		 * Where the turbulence field is sampled in the next update:
+		 * xyz is added to the particle positions, w is field cells per world unit
+		 */
+		void set_turbulence_offset(const glm::vec4 &offset);
+
+		/*
+		 * The hits of the last update, one per enemy in its hit targets,
+		 * or nullptr if there is none. May block.
+		 */
+		virtual const enemy_hit_t * read_hits() = 0;
+
+		/*
+		 * Draw the live particles as points
+		 */
+		virtual void draw() = 0;
+
+		/*
+		 * Set up vertex attrib 0-3 for vertex_t data in the bound array buffer
+		 */
+		static void vertex_attrib_pointers();
+
+		/*
+		 * For vertex_t::scale
+		 */
+		static cl_half float_to_half(float f);
+
+	protected:
+		ParticleBackend(const std::vector<emitter_t> &emitters);
+
+		std::vector<emitter_t> emitters_;
+		const int max_num_particles_; //Reserved by all emitters
+		int num_particles_; //Current size of the pool, the sum of the emitter ranges
+
+		/*
+		 * Called at the start of an update, with the spawn batch of the frame and the number of free
+		 * particles of each emitter after the last update.
+		 * Grows the ranges the batch doesn't fit in (or that ran full) and shrinks the ones that have been
+		 * mostly empty for a while. Calls apply_layout if any range changed.
+		 */
+		void resize_pool(const std::vector<cl_int> &free_counts);
+
+		/*
+		 * Move the particles from old_layout to emitters_. Ranges that shrink have at most
+		 * as many live particles as their new count, which must be moved below it
+		 */
+		virtual void apply_layout(const std::vector<emitter_t> &old_layout) = 0;
+
+		//Seed for this backends random streams, differs between backends created with the same seed
+		const cl_uint seed_;
+
+		glm::vec4 turbulence_offset_;
+
+		//Must be same as in particles_structs.cl
+		struct spawn_request_t {
+			cl_int config_index;
+			cl_int count;
+			cl_int offset; //Sum of count of all previous requests
+			cl_uchar palette_index;
+			cl_uchar emitter;
+			cl_ushort padding;
+		};
+
+		// Spawn batch for the current frame
+		std::vector<config_t> spawn_configs_;
+		std::vector<spawn_request_t> spawn_requests_;
+
+		/*
+		 * Index of the palette entry with the colors and damage of c, adds one if needed.
+		 * When all MAX_PALETTE_SIZE are used the oldest is replaced.
+		 */
+		cl_uchar palette_index(const config_t &c);
+
+		enum { MAX_PALETTE_SIZE = 256 };
+
+		std::vector<palette_entry_t> palette_;
+		size_t palette_next_; //Next to replace when full
+		bool palette_dirty_; //Changed since the backend last read it
+
+		//Updates in a row each emitter used less than a quarter of its range
+		std::vector<int> low_use_frames_;
+};
+
+//Must be same as in particles_structs.cl
+static_assert(sizeof(ParticleSystem::vertex_t) == 24, "vertex_t must match particles_structs.cl");
+static_assert(offsetof(ParticleSystem::vertex_t, color) == 16, "vertex_t must match particles_structs.cl");
+static_assert(offsetof(ParticleSystem::vertex_t, scale) == 20, "vertex_t must match particles_structs.cl");
+static_assert(sizeof(ParticleSystem::config_t) == 272, "config_t must match particles_structs.cl");
+static_assert(sizeof(ParticleBackend::palette_entry_t) == 48, "palette_entry_t must match particles_structs.cl");
+static_assert(sizeof(ParticleBackend::emitter_t) == 16, "emitter_t must match particles_structs.cl");
+
+#endif
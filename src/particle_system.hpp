@@ -6,20 +6,31 @@
 #include "cl.hpp"
 #include <glm/glm.hpp>
 #include <list>
+#include <string>
 #include <utility>
 
+class ParticleWorld;
+
+/*
+ * An emitter of particles, simulated and drawn together with the other emitters of its world.
+ */
 class ParticleSystem : public MovableObject {
 	public:
 
-		ParticleSystem(const int max_num_particles, TextureArray* texture, bool _auto_spawn = true, const std::string &kernel = "particles.cl");
+		ParticleSystem(ParticleWorld * world, const int max_num_particles, bool _auto_spawn = true);
 		virtual ~ParticleSystem();
 
-		virtual void update(float dt);
-		virtual void render(const glm::mat4 * m = nullptr);
-
 		void update_config();
 
-		//Change values in this struct and call update_config() to update
+		//What particles do when they hit the terrain, see ParticleWorld::set_terrain
+		enum ground_response_t {
+			GROUND_NONE = 0, //Fly through it
+			GROUND_KILL,
+			GROUND_BOUNCE,
+			GROUND_STICK
+		};
+
+		//Change values in this struct, the next update of the world hands them to the backend. update_config() does it at once
 		__ALIGNED__(struct config_t {
 				//Time to live
 				cl_float avg_ttl;
@@ -63,6 +74,16 @@ class ParticleSystem : public MovableObject {
 				glm::vec4 wind_velocity;	//Speed
 				glm::vec4 gravity;			//Acceleration
 
+				glm::vec4 lod_camera; //Set by ParticleWorld::set_camera
+				//Beyond x from the camera particles are run every 2nd frame, beyond y every 4th,
+				//beyond z (the fog) color and scale are not interpolated. 0 disables
+				glm::vec4 lod_distances;
+
+				//x: response to the terrain, one of ground_response_t, y: restitution of GROUND_BOUNCE
+				glm::vec4 ground;
+
+				//x: velocity added by the turbulence field at full strength, see ParticleWorld::set_wind
+				glm::vec4 turbulence;
 
 		} config, 16);
 
@@ -70,12 +91,13 @@ class ParticleSystem : public MovableObject {
 		float spawn_rate_var;
 		bool auto_spawn;
 
-		__ALIGNED__(struct vertex_t {
-				glm::vec4 position;
-				glm::vec4 color;
-				float scale;
-				int texture_index;
-		},16);
+		//Must be same as in particles_structs.cl
+		struct vertex_t {
+				glm::vec4 position; //w is rotation
+				cl_uchar color[4];
+				cl_half scale;
+				cl_ushort texture_index;
+		};
 
 		virtual void callback_position(const glm::vec3 &position);
 
@@ -86,58 +108,36 @@ class ParticleSystem : public MovableObject {
 		 * Spawn count elements with current config
 		 */
 		void spawn(int count);
-	protected:
 
-		/**
-		 * Internal function for spawning count particles now
-		 * event is set to the event for the execution
+		/*
+		 * Index in the world
 		 */
-		void spawn_particles(cl_int count,cl::Event * event);
-
-		const int max_num_particles_;
-
-
-		//Texture * texture_;
-
-		// Buffer 0: position buffer 1: color.
-		// Both are set in the opencl-kernel
-		GLuint gl_buffer_;
-		std::vector<cl::BufferGL> cl_gl_buffers_;
-		cl::Buffer particles_, config_, random_, spawn_rate_;
-
-		cl::Program program_;
-		cl::Kernel run_kernel_, spawn_kernel_;
-
-		__ALIGNED__(
-				struct particle_t {
-				glm::vec4 velocity;
-
-				cl_float ttl;
-				cl_float rotation_speed;
-				cl_float initial_scale;
-				cl_float final_scale;
+		int emitter() const;
+	protected:
+		friend class ParticleWorld;
 
-				cl_float wind_influence;
-				cl_float gravity_influence;
-				cl_float org_ttl;
-				cl_int dead;
+		/*
+		 * Used by HittingParticles, hit_test enables the hit test for these particles
+		 */
+		ParticleSystem(ParticleWorld * world, const int max_num_particles, bool _auto_spawn, bool hit_test);
 
-				glm::vec4 birth_color;
-				glm::vec4 death_color;
+		/*
+		 * Hand this frames spawns to the backend, called by ParticleWorld::update
+		 */
+		virtual void add_spawn_requests(float dt);
 
-				cl_int extra1;
-				cl_int extra2;
-				cl_float extra3;
-				cl_float extra4;
-				},16);
+		const int max_num_particles_;
 
-		TextureArray* texture_;
+		ParticleWorld * world_;
+		int emitter_; //Index in the world
 
 
 		typedef std::pair<config_t, int> spawn_data;
 
 		std::list<spawn_data> spawn_list_;
 		std::list<config_t> config_stack_;
+
+		config_t uploaded_config_; //Last config handed to the world by update_config()
 };
 
 
@@ -0,0 +1,154 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "particle_world.hpp"
+#include "gl_state.hpp"
+#include "globals.hpp"
+#include "terrain.hpp"
+#include "texture.hpp"
+#include "utils.hpp"
+
+#include <GL/glew.h>
+#include <algorithm>
+
+//Turbulence field cells per world unit, the field repeats every TURBULENCE_SIZE / this units
+static const float turbulence_cells_per_unit = 0.5f;
+
+ParticleWorld::ParticleWorld(TextureArray * texture, int max_num_enemies)
+	: texture_(texture)
+	, max_num_enemies_(max_num_enemies)
+	, camera_(0.f)
+	, wind_(0.f)
+	, turbulence_offset_(0.f)
+	, backend_(nullptr) {
+	heightfield_.heights = nullptr;
+	heightfield_.size = glm::ivec2(0);
+	heightfield_.horizontal_scale = 1.f;
+}
+
+ParticleWorld::~ParticleWorld() {
+	delete backend_;
+}
+
+TextureArray * ParticleWorld::texture() const {
+	return texture_;
+}
+
+int ParticleWorld::add_emitter(ParticleSystem * emitter, int max_num_particles, bool hit_test) {
+	if(backend_ != nullptr) {
+		fprintf(stderr, "[ParticleSystem] Emitters must be created before the first update of their world\n");
+		util_abort();
+	}
+	if(emitters_.size() > 255) {
+		fprintf(stderr, "[ParticleSystem] A world can't have more than 256 emitters\n");
+		util_abort();
+	}
+
+	//The cpu backend runs four particles at a time, they must all belong to the same emitter.
+	//The range starts small, the backend grows it when needed
+	ParticleBackend::emitter_t e;
+	e.first = layout_.empty() ? 0 : layout_.back().first + layout_.back().count;
+	e.max_count = (max_num_particles + 3) & ~3;
+	e.count = std::min(e.max_count, (cl_int) ParticleBackend::POOL_CHUNK);
+	e.hit_test = hit_test;
+
+	emitters_.push_back(emitter);
+	layout_.push_back(e);
+	configs_.push_back(emitter->config);
+	configs_.back().lod_camera = camera_;
+	configs_.back().wind_velocity = glm::vec4(wind_, 1.f);
+
+	return (int) emitters_.size() - 1;
+}
+
+void ParticleWorld::update_config(int emitter, const config_t &config) {
+	configs_[emitter] = config;
+	configs_[emitter].lod_camera = camera_;
+	configs_[emitter].wind_velocity = glm::vec4(wind_, 1.f);
+	if(backend_ != nullptr) backend_->update_config(emitter, configs_[emitter]);
+}
+
+void ParticleWorld::set_camera(const glm::vec3 &position) {
+	camera_ = glm::vec4(position, 1.f);
+
+	//Only emitters with level of detail care about the camera
+	for(size_t e=0; e < configs_.size(); ++e) {
+		if(configs_[e].lod_distances == glm::vec4(0.f)) continue;
+		update_config((int) e, configs_[e]);
+	}
+}
+
+void ParticleWorld::set_terrain(const Terrain * terrain) {
+	heightfield_.heights = terrain->height_map();
+	heightfield_.size = terrain->size();
+	heightfield_.horizontal_scale = terrain->horizontal_scale();
+	if(backend_ != nullptr) backend_->set_heightfield(heightfield_);
+}
+
+void ParticleWorld::set_wind(const glm::vec3 &velocity) {
+	wind_ = velocity;
+
+	//Pushed at once, also for the emitters whose own config hasn't changed
+	for(size_t e=0; e < configs_.size(); ++e) {
+		update_config((int) e, configs_[e]);
+	}
+}
+
+ParticleBackend * ParticleWorld::backend() {
+	if(backend_ == nullptr) {
+		const std::string kernel = max_num_enemies_ > 0 ? "hitting_particles.cl" : "particles.cl";
+		backend_ = ParticleBackend::create(layout_, kernel, max_num_enemies_);
+		for(size_t e=0; e < configs_.size(); ++e) {
+			backend_->update_config((int) e, configs_[e]);
+		}
+		if(heightfield_.heights != nullptr) backend_->set_heightfield(heightfield_);
+		int reserved = 0;
+		for(const ParticleBackend::emitter_t &e : layout_) reserved += e.max_count;
+		fprintf(verbose, "Created particle world with %lu emitters and %d particles, up to %d\n",
+				(unsigned long) emitters_.size(), layout_.back().first + layout_.back().count, reserved);
+	}
+	return backend_;
+}
+
+void ParticleWorld::update(float dt) {
+	if(emitters_.empty()) return;
+
+	//Normally already done, render() waits for it
+	ParticleBackend * backend = this->backend();
+	backend->begin_update();
+
+	//Moving the sample point against the wind moves the field with it
+	turbulence_offset_ = glm::mod(turbulence_offset_ - wind_ * dt, (float) ParticleBackend::TURBULENCE_SIZE / turbulence_cells_per_unit);
+	backend->set_turbulence_offset(glm::vec4(turbulence_offset_, turbulence_cells_per_unit));
+
+	//All spawn requests of all emitters are handed to the backend as one batch
+	for(ParticleSystem * emitter : emitters_) {
+		emitter->add_spawn_requests(dt);
+	}
+
+	backend->update(dt);
+}
+
+void ParticleWorld::render() {
+	if(backend_ == nullptr) return;
+
+	Shader::push_vertex_attribs();
+
+	GLState::push_attrib(GL_ENABLE_BIT|GL_DEPTH_BUFFER_BIT);
+
+	GLState::depth_mask(GL_FALSE);
+	GLState::disable(GL_CULL_FACE);
+
+	//Particles are spawned in world space
+	Shader::upload_model_matrix(glm::mat4(1.f));
+
+	texture_->texture_bind(Shader::TEXTURE_ARRAY_0);
+
+	//Waits for the simulation to be done with the vertices
+	backend_->draw();
+
+	GLState::pop_attrib();
+
+	Shader::pop_vertex_attribs();
+}
@@ -0,0 +1,80 @@
+#ifndef PARTICLE_WORLD_HPP
+#define PARTICLE_WORLD_HPP
+
+#include "particle_system.hpp"
+#include "particle_backend.hpp"
+
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+/*
+ * Holds the particles of all emitters (ParticleSystems) in one pool, with a range per emitter.
+ * All emitters are simulated in one launch per frame and drawn with one draw call.
+ * The emitters must share the texture array and be created before the first update.
+ */
+class ParticleWorld {
+	public:
+		/*
+		 * max_num_enemies > 0 enables the hit test, for HittingParticles
+		 */
+		ParticleWorld(TextureArray * texture, int max_num_enemies = 0);
+		~ParticleWorld();
+
+		/*
+		 * Spawn and run the particles of all emitters, once per frame
+		 */
+		void update(float dt);
+
+		void render();
+
+		/*
+		 * Camera position for the level of detail of the emitters, see config_t::lod_distances
+		 */
+		void set_camera(const glm::vec3 &position);
+
+		/*
+		 * Terrain for the emitters with config_t::ground, must outlive the world
+		 */
+		void set_terrain(const Terrain * terrain);
+
+		/*
+		 * Wind of all emitters, replaces their config_t::wind_velocity. The turbulence field (config_t::turbulence) drifts with it
+		 */
+		void set_wind(const glm::vec3 &velocity);
+
+		TextureArray * texture() const;
+
+	private:
+		friend class ParticleSystem;
+		friend class HittingParticles;
+
+		typedef ParticleSystem::config_t config_t;
+
+		/*
+		 * Reserve up to max_num_particles for emitter, returns its index. The backend grows its range as needed
+		 */
+		int add_emitter(ParticleSystem * emitter, int max_num_particles, bool hit_test);
+
+		void update_config(int emitter, const config_t &config);
+
+		/*
+		 * Created on first use, no emitters can be added after that
+		 */
+		ParticleBackend * backend();
+
+		TextureArray * texture_;
+		const int max_num_enemies_;
+
+		std::vector<ParticleSystem*> emitters_;
+		std::vector<ParticleBackend::emitter_t> layout_;
+		std::vector<config_t> configs_; //Latest config of each emitter with the camera and wind of the world, handed to the backend when it is created
+		glm::vec4 camera_;
+		ParticleBackend::heightfield_t heightfield_;
+		glm::vec3 wind_;
+		glm::vec3 turbulence_offset_; //Integrated wind
+
+		ParticleBackend * backend_;
+};
+
+#endif
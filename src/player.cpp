@@ -18,7 +18,7 @@ Player::Player() {
 	gun = new RenderObject("canon/gun.obj");
 	cart->yaw(-M_PI/2.f);
 	cart->set_position(glm::vec3(0.f, 0.7f, 0.f));
-	shader = Shader::create_shader("normal");
+	shader_ = Shader::create_shader("normal");
 	canon_pitch.set_rotation(glm::vec3(1.0, 0.0, 0.0), 0.f);
 	canon_yaw.set_rotation(glm::vec3(1.0, 0.0, 0.0), 0.f);
 	path_position_ = 0;
@@ -71,10 +71,14 @@ void Player::render_geometry(const glm::mat4 &m_) {
 
 void Player::render(const glm::mat4 &m) {
 
-	shader->bind();
+	shader_->bind();
 	render_geometry(m);
 }
 
+Shader * Player::shader() const {
+	return shader_;
+}
+
 const float Player::path_position() const { return path_position_; }
 
 glm::vec3 Player::direction() const {
@@ -12,6 +12,7 @@ class Player : public MovableObject {
 
 		void render_geometry(const glm::mat4 &m=glm::mat4());
 		void render(const glm::mat4 &m=glm::mat4());
+		Shader * shader() const;
 
 		void update_position(const Path * path, float pos);
 
@@ -33,7 +34,7 @@ class Player : public MovableObject {
 		float f_canon_pitch, f_canon_yaw;
 
 
-		Shader * shader;
+		Shader * shader_;
 
 		float path_position_;
 };
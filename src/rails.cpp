@@ -29,7 +29,7 @@ static const unsigned int slice_indices = 8;
 
 Rails::Rails(const Path * _path, float _step) : Mesh(), path(_path), step(_step) {
 
-	shader = Shader::create_shader("normal");
+	shader_ = Shader::create_shader("normal");
 
 	glm::vec3 previous = path->at(-step);
 	emit_vertices(0.f, previous);
@@ -176,10 +176,14 @@ void Rails::generate_indices(float p, glm::vec3 &previous) {
 }
 
 void Rails::render(const glm::mat4 &m) {
-	shader->bind();
+	shader_->bind();
 	Mesh::render(m);
 }
 
+Shader * Rails::shader() const {
+	return shader_;
+}
+
 glm::vec3 Rails::perpendicular_vector_at(float pos) const {
 	unsigned int index = (int)floor(pos / step);
 	if(index >= perpendicular_vectors.size()) index = 0;
@@ -13,11 +13,12 @@ class Rails : public Mesh {
 		virtual ~Rails();
 
 		void render(const glm::mat4 &m = glm::mat4());
+		Shader * shader() const;
 
 		glm::vec3 perpendicular_vector_at(float pos) const;
 	private:
 		const Path * path;
-		Shader * shader;
+		Shader * shader_;
 		/**
 		 * The vertex structure is for each slice as follows:
 		 * 1 - 2     6 - 5
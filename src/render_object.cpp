@@ -5,6 +5,7 @@
 #include "platform.h"
 #include "render_object.hpp"
 #include "engine.hpp"
+#include "gl_state.hpp"
 #include "globals.hpp"
 #include "shader.hpp"
 #include "texture.hpp"
@@ -305,6 +306,12 @@ void RenderObject::recursive_pre_render(const aiNode* node) {
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, md.ib);
 			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int)*indexData.size(), &indexData.front(), GL_STATIC_DRAW);
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+			glGenVertexArrays(1, &md.vao);
+			GLState::bind_vertex_array(md.vao);
+			set_vertex_attribs(md);
+			GLState::bind_vertex_array(0);
+			checkForGLErrors("Create vertex array");
 		} else {
 			md.num_indices = 0;
 		}
@@ -316,8 +323,51 @@ void RenderObject::recursive_pre_render(const aiNode* node) {
 	}
 }
 
+void RenderObject::set_vertex_attribs(const mesh_data_t &md) {
+	glBindBuffer(GL_ARRAY_BUFFER, md.vb);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, md.ib);
+
+	for ( int i = 0; i < Shader::NUM_ATTR; ++i ) {
+		glEnableVertexAttribArray(i);
+	}
+	glVertexAttribPointer(Shader::ATTR_POSITION,  3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, pos));
+	glVertexAttribPointer(Shader::ATTR_TEXCOORD,  2, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, uv));
+	glVertexAttribPointer(Shader::ATTR_NORMAL,    3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, normal));
+	glVertexAttribPointer(Shader::ATTR_TANGENT,   3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, tangent));
+	glVertexAttribPointer(Shader::ATTR_BITANGENT, 3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, bitangent));
+	glVertexAttribPointer(Shader::ATTR_COLOR,     4, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, color));
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+GLuint RenderObject::instanced_vao(const mesh_data_t &md, GLuint instance_buffer) const {
+	if ( md.instanced_vao != 0 && md.instance_buffer == instance_buffer ) return md.instanced_vao;
+
+	if ( md.instanced_vao == 0 ) {
+		glGenVertexArrays(1, &md.instanced_vao);
+		GLState::bind_vertex_array(md.instanced_vao);
+		set_vertex_attribs(md);
+	} else {
+		GLState::bind_vertex_array(md.instanced_vao);
+	}
+
+	//A mat4 takes four locations, one column each
+	glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+	for(GLuint i=0; i < 4; ++i) {
+		const GLuint attr = Shader::ATTR_INSTANCE_MATRIX + i;
+		glEnableVertexAttribArray(attr);
+		glVertexAttribPointer(attr, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (const GLvoid*) (sizeof(glm::vec4) * i));
+		glVertexAttribDivisor(attr, 1);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	checkForGLErrors("Create instanced vertex array");
+
+	md.instance_buffer = instance_buffer;
+	return md.instanced_vao;
+}
+
 void RenderObject::recursive_render(const aiNode* node,
-		const glm::mat4 &parent_matrix) const {
+		const glm::mat4 &parent_matrix, GLuint instance_buffer, GLsizei num_instances) const {
 
 
 	aiMatrix4x4 m = node->mTransformation;
@@ -343,29 +393,23 @@ void RenderObject::recursive_render(const aiNode* node,
 			}
 
 			if(md->num_indices > 0) {
-				glBindBuffer(GL_ARRAY_BUFFER, md->vb);
-				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, md->ib);
-
-				glVertexAttribPointer(Shader::ATTR_POSITION,  3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, pos));
-				glVertexAttribPointer(Shader::ATTR_TEXCOORD,  2, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, uv));
-				glVertexAttribPointer(Shader::ATTR_NORMAL,    3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, normal));
-				glVertexAttribPointer(Shader::ATTR_TANGENT,   3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, tangent));
-				glVertexAttribPointer(Shader::ATTR_BITANGENT, 3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, bitangent));
-				glVertexAttribPointer(Shader::ATTR_COLOR,     4, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, color));
-
-				checkForGLErrors("set attrib pointers");
+				GLState::bind_vertex_array(num_instances > 0 ? instanced_vao(*md, instance_buffer) : md->vao);
 
 				materials[md->mtl_index].bind();
 				checkForGLErrors("Activte material");
 
-				glDrawElements(GL_TRIANGLES, md->num_indices, GL_UNSIGNED_INT,0 );
+				if(num_instances > 0) {
+					glDrawElementsInstanced(GL_TRIANGLES, md->num_indices, GL_UNSIGNED_INT, 0, num_instances);
+				} else {
+					glDrawElements(GL_TRIANGLES, md->num_indices, GL_UNSIGNED_INT,0 );
+				}
 				checkForGLErrors("Draw material");
 			}
 		}
 	}
 
 	for(unsigned int i=0; i<node->mNumChildren; ++i) {
-		recursive_render(node->mChildren[i], matrix);
+		recursive_render(node->mChildren[i], matrix, instance_buffer, num_instances);
 	}
 
 }
@@ -373,6 +417,13 @@ void RenderObject::recursive_render(const aiNode* node,
 void RenderObject::render(const glm::mat4& m) const {
 	if ( !scene ) return;
 	recursive_render(scene->mRootNode, m * matrix());
+	GLState::bind_vertex_array(0);
+}
+
+void RenderObject::render_instanced(GLuint instance_buffer, GLsizei count) const {
+	if ( !scene || count <= 0 ) return;
+	recursive_render(scene->mRootNode, matrix(), instance_buffer, count);
+	GLState::bind_vertex_array(0);
 }
 
 const glm::mat4 RenderObject::matrix() const {
@@ -27,7 +27,8 @@ class RenderObject : public MovableObject {
 	void pre_render();
 	void recursive_pre_render(const aiNode* node);
 
-	void recursive_render(const aiNode* node, const glm::mat4 &matrix) const;
+	//num_instances > 0 draws instanced, see render_instanced
+	void recursive_render(const aiNode* node, const glm::mat4 &matrix, GLuint instance_buffer = 0, GLsizei num_instances = 0) const;
 
 public:
 	const aiScene* scene;
@@ -36,11 +37,15 @@ public:
 	glm::vec3 scale;
 
 	struct mesh_data_t {
-		mesh_data_t() : num_indices(0) {};
+		mesh_data_t() : vao(0), num_indices(0), instanced_vao(0), instance_buffer(0) {};
 		GLuint vb, ib; //vertex buffer, index buffer
+		GLuint vao; //Attribute pointers into vb and ib
 		GLenum draw_mode;
 		unsigned int num_indices;
 		unsigned int mtl_index;
+
+		//vao plus the transforms of instance_buffer, made by the first instanced draw
+		mutable GLuint instanced_vao, instance_buffer;
 	};
 
 	//Set normalize_scale to false to not scale down to 1.0
@@ -53,9 +58,19 @@ public:
 
 	void render(const glm::mat4& m = glm::mat4()) const;
 
-	const glm::mat4 matrix() const;
+	/*
+	 * Draw count copies, with the transforms (mat4) in instance_buffer in place of m above.
+	 * The shader reads them from Shader::ATTR_INSTANCE_MATRIX, see InstancedModels.
+	 * The meshes keep pointing into instance_buffer between draws, a different buffer repoints them
+	 */
+	void render_instanced(GLuint instance_buffer, GLsizei count) const;
 
+	const glm::mat4 matrix() const;
 
+private:
+	//Point the attributes of the bound vertex array into the buffers of md
+	static void set_vertex_attribs(const mesh_data_t &md);
+	GLuint instanced_vao(const mesh_data_t &md, GLuint instance_buffer) const;
 };
 
 #endif
@@ -0,0 +1,53 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "render_queue.hpp"
+#include "shader.hpp"
+
+#include <algorithm>
+#include <functional>
+
+bool RenderQueue::item_t::operator<(const item_t &other) const {
+	if(pass != other.pass) return pass < other.pass;
+	if(shader != other.shader) {
+		//The draws using the shader of the pass go first, before any of the others replace it
+		if(shader == nullptr || other.shader == nullptr) return shader == nullptr;
+		return std::less<const Shader*>()(shader, other.shader);
+	}
+	if(material != other.material) return std::less<const void*>()(material, other.material);
+	return std::less<const void*>()(mesh, other.mesh);
+}
+
+RenderQueue::RenderQueue() : sorted_(true) { }
+
+void RenderQueue::add(pass_t pass, Shader * shader, const void * material, const void * mesh, const std::function<void()> &draw) {
+	item_t item;
+	item.pass = pass;
+	item.shader = shader;
+	item.material = material;
+	item.mesh = mesh;
+	item.draw = draw;
+	items_.push_back(item);
+	sorted_ = false;
+}
+
+void RenderQueue::clear() {
+	items_.clear();
+	sorted_ = true;
+}
+
+void RenderQueue::render(pass_t pass) {
+	if(!sorted_) {
+		//Stable, so draws with the same key keep the order they were added in
+		std::stable_sort(items_.begin(), items_.end());
+		sorted_ = true;
+	}
+
+	for(const item_t &item : items_) {
+		if(item.pass != pass) continue;
+		//Shader::bind does nothing if it is already bound
+		if(item.shader != nullptr) item.shader->bind();
+		item.draw();
+	}
+}
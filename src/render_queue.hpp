@@ -0,0 +1,46 @@
+#ifndef RENDER_QUEUE_HPP
+#define RENDER_QUEUE_HPP
+
+#include <functional>
+#include <vector>
+
+/*
+ * Opaque draws sorted by (pass, shader, material, mesh), so draws sharing state are submitted together
+ * and GLState has as little as possible to change between them. The draws are kept until clear()
+ * and each pass can be drawn any number of times, like the geometry pass for shadows and depth.
+ */
+class RenderQueue {
+	public:
+		enum pass_t {
+			PASS_GEOMETRY, //Position only, with the shader bound by the pass
+			PASS_COLOR,
+		};
+
+		RenderQueue();
+
+		/*
+		 * shader is bound before draw, nullptr keeps the shader of the pass. It is only
+		 * bound when it changes. material and mesh order the draws, draw binds them itself
+		 */
+		void add(pass_t pass, Shader * shader, const void * material, const void * mesh, const std::function<void()> &draw);
+
+		void clear();
+
+		void render(pass_t pass);
+
+	private:
+		struct item_t {
+			pass_t pass;
+			Shader * shader;
+			const void * material;
+			const void * mesh;
+			std::function<void()> draw;
+
+			bool operator<(const item_t &other) const;
+		};
+
+		std::vector<item_t> items_;
+		bool sorted_;
+};
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "rendertarget.hpp"
 #include "engine.hpp"
+#include "gl_state.hpp"
 #include "utils.hpp"
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -11,6 +12,7 @@
 
 RenderTarget* RenderTarget::stack = nullptr;
 GLuint RenderTarget::vbo[2] = {0,0};
+GLuint RenderTarget::vao = 0;
 
 RenderTarget::RenderTarget(const glm::ivec2& size, GLenum format, int flags, GLenum filter) throw()
 	: TextureBase()
@@ -39,7 +41,7 @@ RenderTarget::RenderTarget(const glm::ivec2& size, GLenum format, int flags, GLe
 
 	/* bind color buffers */
 	for ( int i = 0; i < 2; i++ ){
-		glBindTexture(GL_TEXTURE_2D, color[i]);
+		GLState::bind_texture(GL_TEXTURE_2D, color[i]);
 		glTexImage2D(GL_TEXTURE_2D, 0, format, size.x, size.y, 0, format == GL_RGB8 ? GL_RGB : GL_RGBA, GL_UNSIGNED_INT, NULL);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -51,7 +53,7 @@ RenderTarget::RenderTarget(const glm::ivec2& size, GLenum format, int flags, GLe
 
 	/* bind depth buffer */
 	if ( flags & DEPTH_BUFFER ){
-		glBindTexture(GL_TEXTURE_2D, depth);
+		GLState::bind_texture(GL_TEXTURE_2D, depth);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, size.x, size.y, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_BYTE, NULL);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -114,8 +116,8 @@ RenderTarget::RenderTarget(const glm::ivec2& size, GLenum format, int flags, GLe
 
 RenderTarget::~RenderTarget(){
 	glDeleteFramebuffers(1, &id);
-	glDeleteTextures(2, color);
-	glDeleteTextures(1, &depth);
+	GLState::delete_textures(2, color);
+	GLState::delete_textures(1, &depth);
 }
 
 void RenderTarget::init_vbo(){
@@ -142,6 +144,22 @@ void RenderTarget::init_vbo(){
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo[1]);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	glGenVertexArrays(1, &vao);
+	GLState::bind_vertex_array(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo[1]);
+	for ( int i = 0; i < Shader::NUM_ATTR; ++i ) {
+		glEnableVertexAttribArray(i);
+	}
+	glVertexAttribPointer(Shader::ATTR_POSITION,  3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, pos));
+	glVertexAttribPointer(Shader::ATTR_TEXCOORD,  2, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, uv));
+	glVertexAttribPointer(Shader::ATTR_NORMAL,    3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, normal));
+	glVertexAttribPointer(Shader::ATTR_TANGENT,   3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, tangent));
+	glVertexAttribPointer(Shader::ATTR_BITANGENT, 3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, bitangent));
+	glVertexAttribPointer(Shader::ATTR_COLOR,     4, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, color));
+	GLState::bind_vertex_array(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 void RenderTarget::bind(){
@@ -188,21 +206,19 @@ const glm::mat4& RenderTarget::ortho() const {
 }
 
 void RenderTarget::texture_bind(Shader::TextureUnit unit) const {
-	glActiveTexture(unit);
-	glBindTexture(GL_TEXTURE_2D, texture());
+	GLState::bind_texture(unit, GL_TEXTURE_2D, texture());
 }
 
 void RenderTarget::texture_unbind() const {
-	glBindTexture(GL_TEXTURE_2D, 0);
+	GLState::bind_texture(GL_TEXTURE_2D, 0);
 }
 
 void RenderTarget::depth_bind(Shader::TextureUnit unit) const {
-	glActiveTexture(unit);
-	glBindTexture(GL_TEXTURE_2D, depthbuffer());
+	GLState::bind_texture(unit, GL_TEXTURE_2D, depthbuffer());
 }
 
 void RenderTarget::depth_unbind() const {
-	glBindTexture(GL_TEXTURE_2D, 0);
+	GLState::bind_texture(GL_TEXTURE_2D, 0);
 }
 
 void RenderTarget::clear(const Color& color){
@@ -237,15 +253,8 @@ void RenderTarget::draw(Shader* shader, const glm::vec2& pos, const glm::vec2& s
 	shader->bind();
 	texture_bind(Shader::TEXTURE_2D_0);
 	depth_bind(Shader::TEXTURE_2D_1);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo[1]);
-
-	glVertexAttribPointer(Shader::ATTR_POSITION,  3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, pos));
-	glVertexAttribPointer(Shader::ATTR_TEXCOORD,  2, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, uv));
-	glVertexAttribPointer(Shader::ATTR_NORMAL,    3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, normal));
-	glVertexAttribPointer(Shader::ATTR_TANGENT,   3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, tangent));
-	glVertexAttribPointer(Shader::ATTR_BITANGENT, 3, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, bitangent));
-	glVertexAttribPointer(Shader::ATTR_COLOR,     4, GL_FLOAT, GL_FALSE, sizeof(Shader::vertex_t), (const GLvoid*)offsetof(Shader::vertex_t, color));
 
+	GLState::bind_vertex_array(vao);
 	glDrawElements(GL_QUADS, 4, GL_UNSIGNED_INT, 0);
+	GLState::bind_vertex_array(0);
 }
@@ -90,6 +90,7 @@ public:
 
 private:
 	static GLuint vbo[2];
+	static GLuint vao;
 	static void init_vbo();
 
 	glm::mat4 projection;
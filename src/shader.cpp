@@ -3,6 +3,7 @@
 #endif
 
 #include "shader.hpp"
+#include "gl_state.hpp"
 #include "globals.hpp"
 #include "light.hpp"
 #include "utils.hpp"
@@ -66,6 +67,14 @@ const GLenum Shader::global_uniform_usage_[] = {
 };
 
 GLuint Shader::global_uniform_buffers_[Shader::NUM_GLOBAL_UNIFORMS];
+
+//Room for the per draw uniforms of a few frames
+static const GLsizeiptr uniform_ring_size = 1 << 20;
+
+GLuint Shader::uniform_ring_ = 0;
+GLintptr Shader::uniform_ring_head_ = 0;
+GLint Shader::uniform_ring_alignment_ = 256;
+
 Shader* Shader::current = nullptr;
 
 typedef std::map<std::string, Shader*> ShaderMap;
@@ -84,11 +93,20 @@ void Shader::initialize() {
 		glBindBuffer(GL_UNIFORM_BUFFER, global_uniform_buffers_[i]);
 		glBufferData(GL_UNIFORM_BUFFER, global_uniform_buffer_sizes_[i], NULL, global_uniform_usage_[i]);
 		//Bind buffers to range
-		glBindBufferRange(GL_UNIFORM_BUFFER, i, global_uniform_buffers_[i], 0, global_uniform_buffer_sizes_[i]);
+		GLState::bind_uniform_range(i, global_uniform_buffers_[i], 0, global_uniform_buffer_sizes_[i]);
 	}
 	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 	checkForGLErrors("Bind and allocate global uniforms");
 
+	//The blocks in the ring stay bound to their own buffer above until the first upload
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_ring_alignment_);
+	glGenBuffers(1, &uniform_ring_);
+	glBindBuffer(GL_UNIFORM_BUFFER, uniform_ring_);
+	glBufferData(GL_UNIFORM_BUFFER, uniform_ring_size, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	uniform_ring_head_ = 0;
+	checkForGLErrors("Allocate uniform ring");
+
 
 	/* Enable all attribs for Shader::vertex_x */
 	for ( int i = 0; i < NUM_ATTR; ++i ) {
@@ -100,6 +118,7 @@ void Shader::initialize() {
 
 void Shader::cleanup(){
 	glDeleteBuffers(NUM_GLOBAL_UNIFORMS, global_uniform_buffers_);
+	glDeleteBuffers(1, &uniform_ring_);
 
 	/* remove all shaders */
 	for ( ShaderPair p: shadercache ){
@@ -122,7 +141,8 @@ Shader::Shader(const std::string &name_, GLuint program) :
 }
 
 Shader::~Shader(){
-	glDeleteProgram(program_);
+	if ( current == this ) current = nullptr;
+	GLState::delete_program(program_);
 }
 
 void Shader::release(){
@@ -351,11 +371,10 @@ void Shader::init_uniforms() {
 void Shader::bind() {
 	if ( this == current ){
 		return; /* do nothing */
-	} else if ( current ){
-		unbind();
 	}
 
-	glUseProgram(program_);
+	/* no need to go through program 0 on the way */
+	GLState::use_program(program_);
 	checkForGLErrors("Bind shader");
 	current = this;
 }
@@ -366,7 +385,7 @@ void Shader::unbind() {
 		util_abort();
 	}
 
-	glUseProgram(0);
+	GLState::use_program(0);
 	checkForGLErrors("Shader::unbind");
 	current = nullptr;
 }
@@ -410,22 +429,49 @@ void Shader::upload_projection_view_matrices(
 	checkForGLErrors("upload projection view matrices");
 }
 
-void Shader::upload_model_matrix(const glm::mat4 &model) {
-	glBindBuffer(GL_UNIFORM_BUFFER, global_uniform_buffers_[UNIFORM_MODEL_MATRICES]);
+void Shader::upload_to_ring(global_uniforms_t block, const void * data, GLsizeiptr size) {
+	const GLintptr align = uniform_ring_alignment_;
+	GLintptr offset = (uniform_ring_head_ + align - 1) / align * align;
+
+	glBindBuffer(GL_UNIFORM_BUFFER, uniform_ring_);
+	if(offset + size > uniform_ring_size) {
+		//Fresh storage, the draws still reading the old one keep it
+		glBufferData(GL_UNIFORM_BUFFER, uniform_ring_size, NULL, GL_STREAM_DRAW);
+		offset = 0;
+	}
 
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), glm::value_ptr(model));
-	glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::mat4), sizeof(glm::mat4), glm::value_ptr(glm::transpose(glm::inverse(model))));
+	//Nothing in flight reads from the head onwards, so there is no need to wait for the GPU
+	void * dst = glMapBufferRange(GL_UNIFORM_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	memcpy(dst, data, size);
+	glUnmapBuffer(GL_UNIFORM_BUFFER);
 
+	GLState::bind_uniform_range(block, uniform_ring_, offset, size);
 	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	uniform_ring_head_ = offset + size;
+}
+
+void Shader::upload_model_matrix(const glm::mat4 &model) {
+	glm::mat4 matrices[2];
+	matrices[0] = model;
+
+	//Inverse transpose of the upper 3x3, its columns are the cofactors over the determinant.
+	//Translation doesn't affect normals, so the rest is left as identity
+	const glm::vec3 x(model[0]), y(model[1]), z(model[2]);
+	const glm::vec3 cx = glm::cross(y, z);
+	const float inv_det = 1.f / glm::dot(x, cx);
+	matrices[1] = glm::mat4(
+			glm::vec4(cx * inv_det, 0.f),
+			glm::vec4(glm::cross(z, x) * inv_det, 0.f),
+			glm::vec4(glm::cross(x, y) * inv_det, 0.f),
+			glm::vec4(0.f, 0.f, 0.f, 1.f));
+
+	upload_to_ring(UNIFORM_MODEL_MATRICES, matrices, sizeof(matrices));
 	checkForGLErrors("upload model matrices");
 }
 
 void Shader::upload_material(const Shader::material_t &material) {
-	glBindBuffer(GL_UNIFORM_BUFFER, global_uniform_buffers_[UNIFORM_MATERIAL]);
-
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(material_t), &material);
-
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	upload_to_ring(UNIFORM_MATERIAL, &material, sizeof(material_t));
 	checkForGLErrors("upload material");
 }
 
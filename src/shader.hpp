@@ -125,6 +125,9 @@ public:
 		ATTR_COLOR,
 
 		NUM_ATTR,
+
+		/* Per instance, not enabled by initialize(). A mat4 taking four locations */
+		ATTR_INSTANCE_MATRIX = NUM_ATTR,
 	};
 
 	struct vertex {
@@ -188,6 +191,15 @@ private:
 	GLint global_uniform_block_index_[NUM_GLOBAL_UNIFORMS];
 	static GLuint global_uniform_buffers_[NUM_GLOBAL_UNIFORMS];
 
+	/*
+	 * The per draw blocks (model matrices and material) are appended to the ring instead of
+	 * rewriting their buffer, and bound with glBindBufferRange. It is orphaned when full.
+	 */
+	static GLuint uniform_ring_;
+	static GLintptr uniform_ring_head_;
+	static GLint uniform_ring_alignment_;
+	static void upload_to_ring(global_uniforms_t block, const void * data, GLsizeiptr size);
+
 	void init_uniforms();
 
 	const GLuint program_;
@@ -4,6 +4,7 @@
 
 #include "skybox.hpp"
 #include "camera.hpp"
+#include "gl_state.hpp"
 #include "texture.hpp"
 #include "utils.hpp"
 
@@ -44,9 +45,9 @@ Skybox::~Skybox() {
 void Skybox::render(const Camera &camera) const{
 	shader->bind();
 
-	glPushAttrib(GL_ENABLE_BIT|GL_DEPTH_BUFFER_BIT);
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	GLState::push_attrib(GL_ENABLE_BIT|GL_DEPTH_BUFFER_BIT);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
 
 	Shader::upload_projection_view_matrices(
 			camera.projection_matrix(),
@@ -66,7 +67,7 @@ void Skybox::render(const Camera &camera) const{
 	checkForGLErrors("Skybox::render(): render");
 
 	Shader::pop_vertex_attribs();
-	glPopAttrib();
+	GLState::pop_attrib();
 
 	checkForGLErrors("Skybox::render(): post");
 }
@@ -128,6 +128,14 @@ float Terrain::height_at(float x_, float y_) const {
 	return height;
 }
 
+const float * Terrain::height_map() const {
+	return map_;
+}
+
+float Terrain::horizontal_scale() const {
+	return horizontal_scale_;
+}
+
 const glm::vec3 &Terrain::normal_at(int x, int y) const {
 	return vertices_[y*size_.x + x].normal;
 }
@@ -182,3 +190,7 @@ void Terrain::render() {
 
 
 }
+
+Shader * Terrain::shader() const {
+	return shader_;
+}
@@ -34,12 +34,19 @@ class Terrain : public Mesh {
 		Terrain(const std::string &file, float horizontal_scale, float vertical_scale, TextureArray * color_, TextureArray * normal_);
 		virtual ~Terrain();
 		virtual void render();
+		Shader * shader() const;
 		const glm::ivec2 &size() const;
 		static glm::vec4 get_pixel_color(int x, int y, SDL_Surface * surface, const glm::ivec2 &size);
 
 		float height_at(float x, float y) const;
 		glm::vec3 normal_at(float x, float y) const;
 
+		/*
+		 * The heights height_at interpolates, row major with size().x per row
+		 */
+		const float * height_map() const;
+		float horizontal_scale() const;
+
 		Material material;
 
 		/*